@@ -19,6 +19,8 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
@@ -26,11 +28,11 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <errno.h>
-#include <netdb.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <stdio.h>
 
@@ -43,51 +45,132 @@
 
 #include "dbus.h"
 #include "storage.h"
+#include "nodedb.h"
 #include "device.h"
 #include "adapter.h"
 #include "settings.h"
-
-#define MAX_PEERS			5
+#include "radio.h"
+#include "table.h"
+#include "wheel.h"
+#include "mux.h"
+#include "resolve.h"
+#include "frame.h"
+#include "spool.h"
+#include "coalesce.h"
+#include "uring.h"
+
+#define MAX_PIPES			5	/* nRF24 hardware data pipes */
+#define MAX_PEERS			256	/* Peers online to knotd */
+#define PIPE_PENDING_MAX		16	/* Downlink frames queued */
+#define PIPE_RESUME			(PIPE_PENDING_MAX / 2)
+#define PIPE_TX_RETRIES			5	/* Per frame: transient errors */
+#define PIPE_TX_RETRY_INTERVAL		10	/* ms */
+#define FRAME_POOL_INIT			64	/* Preallocated frames */
+#define PARKED_TIMEOUT			60000	/* ms */
+#define EVICT_IDLE_MIN			30000	/* ms */
 #define BCAST_TIMEOUT			10000
+#define RADIO_POLL_MIN			1	/* ms */
+#define RADIO_POLL_MAX			16	/* ms */
+#define EXPIRY_TICK			1000	/* ms */
+#define LATENCY_BUCKETS			8	/* < 8 ms ... >= 512 ms */
+#define STORE_GRACE_TIMEOUT		1000	/* ms: knotd gone or closing? */
+#define COALESCE_IOV_MAX		64	/* Frames per write */
 #define KNOTD_UNIX_ADDRESS		"knot"
 
 struct nrf24_adapter {
 	struct nrf24_mac addr;
 	char *path;			/* Object path */
 	bool powered;
+	bool storing;			/* knotd unavailable: uplink is held */
+
+	struct table *devices;		/* All devices: indexed by address */
+	struct wheel *expiry;		/* Unpaired devices: by last seen */
+	struct l_queue *idle_list;	/* Pipes holding a radio socket */
+	struct l_hashmap *pipes;	/* All pipes: indexed by address */
+	struct l_hashmap *pipe_socks;	/* idle_list: indexed by rxsock */
+
+	uint32_t evictions;		/* Idle peers dropped to admit others */
+	uint32_t rejections;		/* Beacons refused: no room left */
+	uint32_t latency[LATENCY_BUCKETS]; /* Beacon to first frame */
 
-	struct l_hashmap *offline_list;	/* Disconnected devices */
-	struct l_hashmap *paging_list;	/* Paging/connecting devices */
-	struct l_hashmap *online_list;	/* Connected devices */
-	struct l_queue *idle_list;	/* Connection mapping */
+	struct l_queue *pool;		/* Pre-connected knotd sockets (l_io) */
+	bool pool_refill;		/* Refill scheduled */
+	int mux_upstream;		/* Multiplexed connect in progress to */
+
+	struct coalesce *coalesce;	/* Uplink flush deadlines: TCP only */
+	uint32_t pool_hits;		/* Attach took a pooled socket */
+	uint32_t pool_misses;		/* Attach connected on demand */
 };
 
+/*
+ * Logical connection between a peer and knotd. Peers online to knotd
+ * outnumber the hardware pipes: inactive peers are parked (radio socket
+ * released, knotd socket kept) and get a pipe back on the next presence
+ * beacon.
+ */
 struct idle_pipe {
 	int refs;
 	struct nrf24_mac addr;	/* Peer/Device address */
-	struct l_idle *idle;	/* Polling idle for radio data */
-	int rxsock;		/* nRF24 HAL COMM socket */
+	int rxsock;		/* nRF24 HAL COMM socket: -1 if parked */
 	int txsock;		/* knotd/upperlayer socket */
+	struct l_io *io;	/* Monitors traffic from knotd */
+	struct uring_recv *recv; /* io_uring: takes over io reads */
+	struct l_queue *pending; /* Downlink frames: TX queue */
+	struct l_timeout *tx_retry; /* Head of pending: radio was busy */
+	unsigned int tx_attempts; /* Failed writes of the head frame */
+	bool tx_inflight;	/* Radio thread: head frame result pending */
+	bool tx_paused;		/* Queue full: knotd reads paused */
+	bool connecting;	/* knotd connect in progress */
+	int upstream;		/* Resolved address of txsock: TCP only */
+	struct l_queue *uplink;	/* Radio frames held while connecting */
+	struct spool *spool;	/* Held frames overflow: oldest first */
+	struct l_queue *coalesced; /* Uplink frames not written yet */
+	size_t coalesced_len;	/* Bytes in coalesced not written yet */
+	size_t coalesced_sent;	/* Head of coalesced: bytes written */
+	bool coalesce_blocked;	/* Socket full: finished once writable */
+	struct l_timeout *grace; /* knotd closed it: wait for outage */
 	uint32_t timestamp;	/* Timestamp of the last received data */
+	struct l_timeout *deadline; /* Paging only: connection attempt */
+	uint32_t paging_start;	/* Timestamp of the presence beacon */
+};
+
+enum device_state {
+	DEVICE_OFFLINE,			/* Disconnected devices */
+	DEVICE_PAGING,			/* Paging/connecting devices */
+	DEVICE_ONLINE,			/* Connected devices */
+};
+
+struct pool_entry {
+	struct l_io *io;	/* Pre-connected knotd socket */
+	int upstream;		/* Resolved address: TCP only */
 };
 
 static struct nrf24_adapter adapter; /* Supports only one local adapter */
-static struct l_idle *mgmt_idle;
+static struct l_timeout *radio_poll;	/* Radio scheduler */
+static unsigned int radio_poll_interval;
 static struct l_timeout *mgmt_timeout;
-static struct in_addr inet_address;
-static int tcp_port;
+static struct l_timeout *expiry_timeout;	/* Ticks adapter.expiry */
 static int mgmtfd;
 
 static void idle_pipe_free(struct idle_pipe *pipe)
 {
 	hal_log_info("idle_pipe_free(%p)", pipe);
 
-	if (pipe->rxsock)
-		hal_comm_close(pipe->rxsock);
-
-	if (pipe->txsock)
-		close(pipe->txsock);
-
+	if (pipe->rxsock >= 0)
+		radio_comm_close(pipe->rxsock);
+
+	/* Closes txsock: receive cancelled first */
+	uring_recv_free(pipe->recv);
+	l_io_destroy(pipe->io);
+
+	l_timeout_remove(pipe->tx_retry);
+	l_timeout_remove(pipe->grace);
+	l_queue_destroy(pipe->pending, (l_queue_destroy_func_t) frame_unref);
+	l_queue_destroy(pipe->uplink, (l_queue_destroy_func_t) frame_unref);
+	spool_free(pipe->spool);
+	coalesce_cancel(adapter.coalesce, pipe);
+	l_queue_destroy(pipe->coalesced,
+			(l_queue_destroy_func_t) frame_unref);
 	l_free(pipe);
 }
 
@@ -116,30 +199,11 @@ static void idle_pipe_unref(struct idle_pipe *pipe)
 	idle_pipe_free(pipe);
 }
 
-static bool pipe_match_addr(const void *a, const void *b)
-{
-	const struct idle_pipe *pipe = a;
-	const struct nrf24_mac *addr = b;
-	int ret = memcmp(&pipe->addr, addr, sizeof(pipe->addr));
-
-	return (ret ? false : true);
-}
-
-static bool pipe_match_rxsock(const void *a, const void *b)
-{
-	const struct idle_pipe *pipe = a;
-	const int rxsock = L_PTR_TO_INT(b);
-
-	return (pipe->rxsock == rxsock ? true : false);
-}
-
 static unsigned int nrf24_mac_hash(const void *p)
 {
 	const struct nrf24_mac *addr = p;
-	uint32_t most = addr->address.uint64 >> 32;
-	uint32_t less = addr->address.uint64;
 
-	return (most | less);
+	return table_hash(addr->address.uint64);
 }
 
 static int nrf24_mac_compare(const void *a, const void *b)
@@ -150,14 +214,34 @@ static int nrf24_mac_compare(const void *a, const void *b)
 	return memcmp(mac1, mac2, sizeof(struct nrf24_mac));
 }
 
-static void *nrf24_dup(const void *a)
+static struct nrf24_device *device_lookup(const struct nrf24_mac *addr,
+					  enum device_state *state)
+{
+	struct nrf24_device *device;
+	int value;
+
+	device = table_lookup(adapter.devices, addr->address.uint64, &value);
+	if (device && state)
+		*state = value;
+
+	return device;
+}
+
+static bool device_in_state(const struct nrf24_mac *addr,
+			    enum device_state state)
 {
-	return l_memdup(a, sizeof(struct nrf24_mac));
+	enum device_state value;
+
+	if (!device_lookup(addr, &value))
+		return false;
+
+	return value == state;
 }
 
-static void nrf24_destroy(void *a)
+static void device_set_state(const struct nrf24_mac *addr,
+			     enum device_state state)
 {
-	l_free(a);
+	table_set_state(adapter.devices, addr->address.uint64, state);
 }
 
 static int unix_connect(void)
@@ -183,40 +267,31 @@ static int unix_connect(void)
 	return sock;
 }
 
-static int tcp_init(const char *host)
-{
-	struct hostent *hostent;		/* Host information */
-	int err;
-
-	hostent = gethostbyname(host);
-	if (hostent == NULL) {
-		err = errno;
-		hal_log_error("gethostbyname(): %s(%d)", strerror(err), err);
-		return -err;
-	}
-
-	inet_address.s_addr = *((unsigned long *) hostent-> h_addr_list[0]);
-
-	return 0;
-}
-
-static int tcp_connect(void)
+/*
+ * Non-blocking connect never stalls the main loop when the remote knotd
+ * is slow or down: the socket becomes writable once connected (see
+ * tcp_connected()).
+ */
+static int tcp_connect(bool nonblock, int *upstream)
 {
-	struct sockaddr_in server;
+	struct sockaddr_storage server;
+	socklen_t len;
 	int err, sock, enable = 1;
 
-	sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	/* Resolved asynchronously: nothing to connect to until then */
+	*upstream = resolve_get(&server, &len);
+	if (*upstream < 0)
+		return *upstream;
+
+	sock = socket(server.ss_family,
+		      SOCK_STREAM | (nonblock ? SOCK_NONBLOCK : 0),
+		      IPPROTO_TCP);
 	if (sock < 0) {
 		err = errno;
 		hal_log_error("socket(): %s(%d)", strerror(err), err);
 		return -err;
 	}
 
-	memset(&server, 0, sizeof(server));
-	server.sin_family = AF_INET;
-	server.sin_addr.s_addr = inet_address.s_addr;
-	server.sin_port = htons(tcp_port);
-
 	if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable,
 						sizeof(enable)) == -1) {
 		err = errno;
@@ -226,232 +301,1432 @@ static int tcp_connect(void)
 		return -err;
 	}
 
-	err = connect(sock, (struct sockaddr *) &server, sizeof(server));
-	if (err < 0) {
+	err = connect(sock, (struct sockaddr *) &server, len);
+	if (err < 0 && (!nonblock || errno != EINPROGRESS)) {
+		err = errno;
 		close(sock);
-		return -errno;
+		resolve_failed(*upstream);
+		return -err;
 	}
 
 	return sock;
 }
 
+/*
+ * Completes a non-blocking connect. Returns 0 once connected. The socket
+ * stays non-blocking: uplink frames are written by pipe_coalesce_flush().
+ */
+static int tcp_connected(int sock)
+{
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		return -errno;
+
+	return -err;
+}
+
+/*
+ * Upper layer socket: knotd. TCP may still be connecting if nonblock,
+ * upstream is the resolved address used (see resolve_failed()).
+ */
+static int knotd_connect(bool nonblock, int *upstream)
+{
+	*upstream = -1;
+
+	if (settings.host)
+		return tcp_connect(nonblock, upstream);
+
+	return unix_connect();
+}
+
+static void pool_destroy(void *data)
+{
+	struct pool_entry *entry = data;
+
+	/* Closes the socket */
+	l_io_destroy(entry->io);
+	l_free(entry);
+}
+
+static void pool_drop_oneshot(void *user_data)
+{
+	if (l_queue_remove(adapter.pool, user_data))
+		pool_destroy(user_data);
+}
+
+static void pool_disconnect(struct l_io *io, void *user_data)
+{
+	struct pool_entry *entry = user_data;
+
+	/* Connect in progress failed rather than knotd closing it? */
+	if (entry->upstream >= 0 && tcp_connected(l_io_get_fd(io)) < 0)
+		resolve_failed(entry->upstream);
+
+	/* Never destroy the l_io from its own callback */
+	l_idle_oneshot(pool_drop_oneshot, entry, NULL);
+}
+
+static void pool_fill(void *user_data)
+{
+	struct pool_entry *entry;
+	int sock, upstream;
+
+	adapter.pool_refill = false;
+
+	while (adapter.pool &&
+	       l_queue_length(adapter.pool) < (unsigned int) settings.pool) {
+		sock = knotd_connect(true, &upstream);
+		if (sock < 0) {
+			hal_log_error("pool connect(): %s(%d)",
+				      strerror(-sock), -sock);
+			return;
+		}
+
+		entry = l_new(struct pool_entry, 1);
+		entry->upstream = upstream;
+		entry->io = l_io_new(sock);
+		l_io_set_close_on_destroy(entry->io, true);
+		l_io_set_disconnect_handler(entry->io, pool_disconnect, entry,
+					    NULL);
+		l_queue_push_tail(adapter.pool, entry);
+	}
+}
+
+/* Tops up the pool from the main loop, off the attach path */
+static void pool_schedule(void)
+{
+	/* Multiplexed mode has a single connection: nothing to pool */
+	if (!settings.pool || settings.mux || adapter.pool_refill ||
+							adapter.storing)
+		return;
+
+	adapter.pool_refill = l_idle_oneshot(pool_fill, NULL, NULL);
+}
+
+static int pool_take(int *upstream)
+{
+	struct pool_entry *entry;
+	int sock;
+
+	entry = l_queue_pop_head(adapter.pool);
+	pool_schedule();
+
+	if (!entry) {
+		adapter.pool_misses++;
+		return knotd_connect(true, upstream);
+	}
+
+	adapter.pool_hits++;
 
-static void io_destroy(void *user_data)
+	/* Handed over to the pipe: keep it open */
+	sock = l_io_get_fd(entry->io);
+	*upstream = entry->upstream;
+	l_io_set_close_on_destroy(entry->io, false);
+	pool_destroy(entry);
+
+	return sock;
+}
+
+/* Moves the device of a pipe back to offline (from online or paging) */
+static void pipe_set_offline(struct idle_pipe *pipe)
 {
-	int nrf24sk = L_PTR_TO_INT(user_data);
 	struct nrf24_device *device;
-	struct nrf24_mac addr;
+	enum device_state state;
 
-	/* Handling knotd initiated disconnection */
-	device = l_hashmap_remove(adapter.online_list, user_data);
-	if (!device)
+	device = device_lookup(&pipe->addr, &state);
+	if (!device || state == DEVICE_OFFLINE)
 		return;
 
-	device_get_address(device, &addr);
+	device_set_state(&pipe->addr, DEVICE_OFFLINE);
 	device_set_connected(device, false);
+}
 
-	l_hashmap_insert(adapter.offline_list, &addr, device);
+/* Releases the radio socket of a pipe */
+static void pipe_detach(struct idle_pipe *pipe)
+{
+	l_hashmap_remove(adapter.pipe_socks, L_INT_TO_PTR(pipe->rxsock));
+	l_queue_remove(adapter.idle_list, pipe);
+
+	radio_comm_close(pipe->rxsock);
+	pipe->rxsock = -1;
 
-	hal_comm_close(nrf24sk);
+	/* Queued frames wait for the next radio pipe */
+	l_timeout_remove(pipe->tx_retry);
+	pipe->tx_retry = NULL;
+	pipe->tx_attempts = 0;
+	pipe->tx_inflight = false;
 }
 
-static bool io_read(struct l_io *io, void *user_data)
+/*
+ * Writes the coalesced uplink frames of a pipe: TCP is a byte stream,
+ * one write per COALESCE_IOV_MAX frames instead of one per frame. Frames
+ * leave the queue once fully written: never split on the stream. Returns
+ * -EAGAIN if the socket is full.
+ */
+static int pipe_coalesce_write(struct idle_pipe *pipe)
 {
-	int txsock = L_PTR_TO_INT(user_data); /* Radio */
-	char buffer[128];
-	ssize_t rx;
-	ssize_t tx;
-	int rxsock; /* knotd */
+	const struct l_queue_entry *entry;
+	struct iovec iov[COALESCE_IOV_MAX];
+	struct frame *frame;
+	struct msghdr msg;
+	unsigned int count;
+	size_t len, offset, done;
+	ssize_t sent;
 	int err;
 
-	/* Reading data from knotd */
-	rxsock = l_io_get_fd(io);
-	rx = read(rxsock, buffer, sizeof(buffer));
-	if (rx < 0) {
-		err = errno;
-		hal_log_error("read(): %s (%d)", strerror(err), err);
-		return true;
-	}
+	while (!l_queue_isempty(pipe->coalesced)) {
+		len = 0;
+		offset = pipe->coalesced_sent;
+		entry = l_queue_get_entries(pipe->coalesced);
+		for (count = 0; entry && count < COALESCE_IOV_MAX;
+						entry = entry->next, count++) {
+			frame = entry->data;
+			iov[count].iov_base = frame->data + offset;
+			iov[count].iov_len = frame->len - offset;
+			len += iov[count].iov_len;
+			offset = 0;
+		}
 
-	/* Sendind data to thing */
-	/* TODO: put data in list for transmission */
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
 
-	tx = hal_comm_write(txsock, buffer, rx);
-	if (tx < 0)
-		hal_log_error("hal_comm_write(): %zd", tx);
+		sent = sendmsg(pipe->txsock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sent < 0) {
+			err = errno;
+			if (err == EINTR)
+				continue;
 
-	return true;
+			if (err == EAGAIN)
+				return -EAGAIN;
+
+			/* Connection gone: io_disconnect() takes over */
+			hal_log_error("write to knotd: %s(%d)",
+				      strerror(err), err);
+			return -err;
+		}
+
+		pipe->coalesced_len -= sent;
+		done = pipe->coalesced_sent + sent;
+
+		/* Written frames are released, the rest waits in order */
+		while ((frame = l_queue_peek_head(pipe->coalesced)) &&
+						done >= frame->len) {
+			done -= frame->len;
+			frame_unref(l_queue_pop_head(pipe->coalesced));
+		}
+
+		pipe->coalesced_sent = done;
+
+		if ((size_t) sent < len)
+			return -EAGAIN;
+	}
+
+	return 0;
 }
 
-static void remove_pipe_oneshot_destroy(void *user_data)
+/* Socket writable again: the tail left by pipe_coalesce_flush() */
+static bool io_coalesce_writable(struct l_io *io, void *user_data)
 {
 	struct idle_pipe *pipe = user_data;
-	idle_pipe_unref(pipe);
+
+	if (pipe_coalesce_write(pipe) == -EAGAIN)
+		return true;
+
+	pipe->coalesce_blocked = false;
+
+	return false;
 }
 
-static void remove_pipe_oneshot(void *user_data)
+static void pipe_coalesce_flush(struct idle_pipe *pipe)
 {
-	struct idle_pipe *pipe = user_data;
-	/* Calls radio_idle_destroy */
-	l_idle_remove(pipe->idle);
+	/* Frames coalesced meanwhile go out with the tail */
+	if (pipe->coalesce_blocked)
+		return;
+
+	if (pipe_coalesce_write(pipe) != -EAGAIN)
+		return;
+
+	pipe->coalesce_blocked = true;
+	l_io_set_write_handler(pipe->io, io_coalesce_writable, pipe, NULL);
 }
 
-/* Called at adapter_stop() */
-static void pipe_destroy(void *user_data)
+static void pipe_coalesce_expired(void *data, void *user_data)
 {
-	struct idle_pipe *pipe = user_data;
+	pipe_coalesce_flush(data);
+}
+
+/* Cancels the first frame deadline armed by pipe_paging_start() */
+static void pipe_paging_stop(struct idle_pipe *pipe)
+{
+	l_timeout_remove(pipe->deadline);
+	pipe->deadline = NULL;
+}
 
-	l_idle_remove(pipe->idle);
+/* Removes a pipe from the registry: closes radio and knotd sockets */
+static void pipe_release(struct idle_pipe *pipe)
+{
+	pipe_paging_stop(pipe);
+
+	if (pipe->rxsock >= 0)
+		pipe_detach(pipe);
+
+	/* Multiplexed upstream: knotd learns it from a control frame */
+	if (settings.mux)
+		mux_close(pipe->addr.address.uint64);
+
+	/* Pending uplink data goes out before knotd sees the close */
+	if (!l_queue_isempty(pipe->coalesced) && pipe->txsock >= 0) {
+		coalesce_cancel(adapter.coalesce, pipe);
+		if (pipe_coalesce_write(pipe) < 0)
+			hal_log_error("write to knotd: %zu byte(s) dropped",
+				      pipe->coalesced_len);
+
+		l_io_set_write_handler(pipe->io, NULL, NULL, NULL);
+	}
+
+	l_hashmap_remove(adapter.pipes, &pipe->addr);
 	idle_pipe_unref(pipe);
 }
 
-static void radio_idle_destroy(void *user_data)
+static void pipe_disconnect(struct idle_pipe *pipe)
+{
+	/* Adapter disabled, or already released? */
+	if (!adapter.powered ||
+			l_hashmap_lookup(adapter.pipes, &pipe->addr) != pipe)
+		return;
+
+	pipe_set_offline(pipe);
+	pipe_release(pipe);
+}
+
+static void pipe_disconnect_oneshot(void *user_data)
+{
+	pipe_disconnect(user_data);
+}
+
+static void pipe_oneshot_destroy(void *user_data)
 {
 	idle_pipe_unref(user_data);
 }
 
-static void radio_idle_read(struct l_idle *idle, void *user_data)
+static void pipe_tx_update(struct idle_pipe *pipe, bool drop, bool retry)
 {
-	struct idle_pipe *pipe = user_data;
 	struct nrf24_device *device;
-	uint8_t buffer[256];
-	int rx, err;
-	uint32_t timestamp = hal_time_ms();
-	bool online;
-
-	rx = hal_comm_read(pipe->rxsock, &buffer, sizeof(buffer));
-	if (rx <= 0) {
-		if (hal_timeout(timestamp, pipe->timestamp, 500) > 0) {
-			/* Connection attempt failed */
-			online = false;
-			goto done;
-		} else
-			return;
-	}
 
-	pipe->timestamp = timestamp;
-	if (write(pipe->txsock, buffer, rx) < 0) {
-		err = errno;
-		hal_log_error("write to knotd: %s(%d)",
-			      strerror(err), err);
-	}
-	/*
-	 * FIXME: MGMT should be extended to notify connection
-	 * complete event for host initiated connection.
-	 */
-	online = true;
-done:
-	device = l_hashmap_remove(adapter.paging_list, &pipe->addr);
+	device = device_lookup(&pipe->addr, NULL);
 	if (!device)
 		return;
 
-	if (online) {
-		l_hashmap_insert(adapter.online_list,
-				 L_INT_TO_PTR(pipe->rxsock), device);
-		device_set_connected(device, true);
-	} else {
-		l_hashmap_insert(adapter.offline_list, &pipe->addr, device);
-		if (l_queue_remove(adapter.idle_list, pipe) == false)
-			return;
+	device_set_tx_queued(device, l_queue_length(pipe->pending));
 
-		l_idle_oneshot(remove_pipe_oneshot, pipe,
-			       remove_pipe_oneshot_destroy);
-	}
+	if (drop)
+		device_inc_tx_drops(device);
+
+	if (retry)
+		device_inc_tx_retries(device);
 }
 
-static bool offline_foreach(const void *key, void *value, void *user_data)
+static bool io_read(struct l_io *io, void *user_data);
+static void pipe_flush(struct idle_pipe *pipe);
+
+static void pipe_tx_retry(struct l_timeout *timeout, void *user_data)
 {
-	struct nrf24_device *device = value;
-	uint32_t ctime = L_PTR_TO_UINT(user_data);
-	struct nrf24_mac addr;
-	char str[24];
+	struct idle_pipe *pipe = user_data;
 
-	if (device_is_paired(device))
-		return false;
+	l_timeout_remove(pipe->tx_retry);
+	pipe->tx_retry = NULL;
+
+	pipe_flush(pipe);
+}
+
+static bool radio_busy(ssize_t err)
+{
+	return err == -EAGAIN || err == -EBUSY || err == -ENOBUFS;
+}
 
-	if (hal_timeout(ctime, device_get_last_seen(value), 7000) == 0)
+/*
+ * Result of writing the head frame. A frame failing with a transient
+ * error stays at the head and is retried later, up to PIPE_TX_RETRIES
+ * times. Returns false if so.
+ */
+static bool pipe_tx_done(struct idle_pipe *pipe, ssize_t tx)
+{
+	if (tx < 0 && radio_busy(tx) && pipe->tx_attempts < PIPE_TX_RETRIES) {
+		pipe->tx_attempts++;
+		pipe->tx_retry = l_timeout_create_ms(PIPE_TX_RETRY_INTERVAL,
+						     pipe_tx_retry, pipe, NULL);
+		pipe_tx_update(pipe, false, true);
 		return false;
+	}
 
-	device_get_address(device, &addr);
-	nrf24_mac2str(&addr, str);
-	hal_log_info("Destroying %p %s", device, str);
-	device_destroy(device);
+	if (tx < 0) {
+		hal_log_error("radio_comm_write(): %zd", tx);
+		pipe_tx_update(pipe, true, false);
+	}
+
+	pipe->tx_attempts = 0;
+	frame_unref(l_queue_pop_head(pipe->pending));
 
 	return true;
 }
 
-static bool paging_foreach(const void *key, void *value, void *user_data)
+/*
+ * Writes queued downlink frames to the radio in order. With the radio
+ * thread, one frame at a time: the next one goes once the result of the
+ * head is back (see radio_thread_written()). Draining the queue resumes
+ * knotd reads.
+ */
+static void pipe_flush(struct idle_pipe *pipe)
 {
-	const struct nrf24_mac *addr = key;
-	struct nrf24_device *device1 = value;
-	struct nrf24_device *device2 = user_data;
-	struct idle_pipe *pipe;
+	struct frame *frame;
+	ssize_t tx;
 
-	if (device1 != device2)
-		return false;
+	/* Parked, waiting for the retry timer or for the radio thread */
+	if (pipe->rxsock < 0 || pipe->tx_retry || pipe->tx_inflight)
+		return;
 
-	pipe = l_queue_remove_if(adapter.idle_list, pipe_match_addr, addr);
-	if (!pipe)
-		return false;
+	while ((frame = l_queue_peek_head(pipe->pending)) != NULL) {
+		tx = radio_comm_write(pipe->rxsock, frame->data, frame->len);
+		if (tx >= 0 && radio_thread_is_running()) {
+			pipe->tx_inflight = true;
+			break;
+		}
+
+		if (!pipe_tx_done(pipe, tx))
+			break;
+	}
 
-	l_idle_oneshot(remove_pipe_oneshot, pipe, remove_pipe_oneshot_destroy);
+	pipe_tx_update(pipe, false, false);
 
-	return true;
+	if (pipe->tx_paused && l_queue_length(pipe->pending) < PIPE_RESUME) {
+		pipe->tx_paused = false;
+		if (pipe->recv)
+			uring_recv_resume(pipe->recv);
+		else
+			l_io_set_read_handler(pipe->io, io_read, pipe, NULL);
+	}
 }
 
-static bool online_foreach(const void *key, void *value, void *user_data)
+/*
+ * knotd is gone: keeps the radio link up and holds uplink frames until
+ * knotd is back. Downlink frames already queued are still delivered.
+ */
+static void pipe_upstream_lost(struct idle_pipe *pipe)
 {
-	const int *rxsock = key;
-	struct nrf24_device *device1 = value;
-	struct nrf24_device *device2 = user_data;
-	struct idle_pipe *pipe;
+	struct l_queue *held = pipe->coalesced;
+	struct frame *frame;
+
+	/* Not written yet: held first, ahead of the frames to come */
+	coalesce_cancel(adapter.coalesce, pipe);
+	while ((frame = l_queue_pop_head(pipe->uplink)))
+		l_queue_push_tail(held, frame);
+
+	pipe->coalesced = pipe->uplink;
+	pipe->coalesced_len = 0;
+	pipe->uplink = held;
+
+	/* Partly written head: sent whole on the next connection */
+	pipe->coalesced_sent = 0;
+	pipe->coalesce_blocked = false;
+
+	/* Closes txsock: receive cancelled first */
+	uring_recv_free(pipe->recv);
+	pipe->recv = NULL;
+	l_io_destroy(pipe->io);
+	pipe->io = NULL;
+	pipe->txsock = -1;
+	pipe->upstream = -1;
+	pipe->connecting = true;
+	pipe->tx_paused = false;
+
+	l_timeout_remove(pipe->grace);
+	pipe->grace = NULL;
+}
 
-	if (device1 != device2)
-		return false;
+/* knotd closed the connection but is still around: a regular disconnect */
+static void pipe_grace_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct idle_pipe *pipe = user_data;
 
-	pipe = l_queue_remove_if(adapter.idle_list, pipe_match_rxsock, rxsock);
-	if (!pipe)
-		return false;
+	l_timeout_remove(pipe->grace);
+	pipe->grace = NULL;
 
-	l_idle_oneshot(remove_pipe_oneshot, pipe, remove_pipe_oneshot_destroy);
+	pipe_disconnect(pipe);
+}
 
-	return true;
+/*
+ * Store-and-forward: the connection may drop before knotd leaves the
+ * bus. Frames are held for a while, and the device is disconnected
+ * unless the adapter gets suspended meanwhile.
+ */
+static void pipe_lost(struct idle_pipe *pipe)
+{
+	/* Adapter disabled, or already released? */
+	if (!adapter.powered ||
+			l_hashmap_lookup(adapter.pipes, &pipe->addr) != pipe)
+		return;
+
+	pipe_upstream_lost(pipe);
+
+	if (!adapter.storing)
+		pipe->grace = l_timeout_create_ms(STORE_GRACE_TIMEOUT,
+						  pipe_grace_timeout, pipe,
+						  NULL);
 }
 
-static void remove_device_oneshot(void *user_data)
+static void pipe_lost_oneshot(void *user_data)
 {
-	struct nrf24_device *device = user_data;
-	/*
-	 * Never call at the same loop
-	 * FIXME: Find better approach. Device object
-	 * should not be unregistered at the same loop.
-	 */
-	device_destroy(device);
+	pipe_lost(user_data);
 }
 
-static void forget_cb(struct nrf24_device *device, void *user_data)
+static void io_disconnect(struct l_io *io, void *user_data)
 {
-	struct nrf24_adapter *adapter = user_data;
-	struct nrf24_mac addr;
+	struct idle_pipe *pipe = user_data;
+
+	/* Handling knotd initiated disconnection: never at the same loop */
+	l_idle_oneshot(settings.store_frames ? pipe_lost_oneshot :
+		       pipe_disconnect_oneshot, idle_pipe_ref(pipe),
+		       pipe_oneshot_destroy);
+}
+
+/*
+ * Queues a frame from knotd to the peer of a pipe, taking over the
+ * reference. Parked peers get it with their next radio pipe. Returns
+ * false once the queue is full.
+ */
+static bool pipe_downlink(struct idle_pipe *pipe, struct frame *frame)
+{
+	const struct l_queue_entry *entry;
+	struct frame *oldest;
+	char mac_str[24];
+
+	/* Only the shared multiplexed connection can't be paused */
+	if (l_queue_length(pipe->pending) >= PIPE_PENDING_MAX) {
+		nrf24_mac2str(&pipe->addr, mac_str);
+		hal_log_error("%s: TX queue full, dropping frame", mac_str);
+
+		/* Head handed over to the radio thread: the next one */
+		entry = l_queue_get_entries(pipe->pending);
+		if (pipe->tx_inflight)
+			entry = entry->next;
+		else
+			pipe->tx_attempts = 0;
+
+		oldest = entry->data;
+		l_queue_remove(pipe->pending, oldest);
+		frame_unref(oldest);
+		pipe_tx_update(pipe, true, false);
+	}
+
+	l_queue_push_tail(pipe->pending, frame);
+
+	pipe_flush(pipe);
+
+	/* pipe_flush() updates stats only if attached */
+	if (pipe->rxsock < 0)
+		pipe_tx_update(pipe, false, false);
+
+	return l_queue_length(pipe->pending) < PIPE_PENDING_MAX;
+}
+
+static bool io_read(struct l_io *io, void *user_data)
+{
+	struct idle_pipe *pipe = user_data;
+	struct frame *frame;
+	ssize_t rx;
+	int err;
+
+	/* Reading data from knotd: straight into the queued frame */
+	frame = frame_new();
+	rx = read(pipe->txsock, frame->data, sizeof(frame->data));
+	if (rx < 0) {
+		err = errno;
+		if (err != EAGAIN && err != EINTR)
+			hal_log_error("read(): %s (%d)", strerror(err), err);
+		frame_unref(frame);
+		return true;
+	}
+
+	frame->len = rx;
+
+	/* Backpressure: knotd blocks on a full socket until TX drains */
+	if (!pipe_downlink(pipe, frame)) {
+		pipe->tx_paused = true;
+		return false;
+	}
+
+	return true;
+}
+
+static struct idle_pipe *pipe_lookup_id(uint64_t id)
+{
+	struct nrf24_mac addr = { .address.uint64 = id };
+
+	return l_hashmap_lookup(adapter.pipes, &addr);
+}
+
+static void mux_data(uint64_t id, const void *buffer, size_t len,
+		     void *user_data)
+{
+	struct idle_pipe *pipe = pipe_lookup_id(id);
+	struct frame *frame;
+	char mac_str[24];
+
+	if (!pipe)
+		return;
+
+	/* Frames are reassembled in the mux buffer: copied once */
+	frame = frame_new_copy(buffer, len);
+	if (!frame) {
+		nrf24_mac2str(&pipe->addr, mac_str);
+		hal_log_error("%s: dropping %zu byte(s) frame, too long",
+			      mac_str, len);
+		return;
+	}
+
+	pipe_downlink(pipe, frame);
+}
+
+static void mux_closed(uint64_t id, void *user_data)
+{
+	struct idle_pipe *pipe = pipe_lookup_id(id);
+
+	if (pipe)
+		pipe_disconnect(pipe);
+}
+
+static void pipe_collect(const void *key, void *value, void *user_data)
+{
+	l_queue_push_tail(user_data, idle_pipe_ref(value));
+}
+
+static void pipe_disconnect_unref(void *data)
+{
+	pipe_disconnect(data);
+	idle_pipe_unref(data);
+}
+
+static void pipe_lost_unref(void *data)
+{
+	pipe_lost(data);
+	idle_pipe_unref(data);
+}
+
+/* Multiplexed connection lost: every peer loses knotd at once */
+static void mux_disconnected(void *user_data)
+{
+	struct l_queue *list = l_queue_new();
+
+	/* Connect in progress failed rather than knotd closing it? */
+	if (adapter.mux_upstream >= 0) {
+		resolve_failed(adapter.mux_upstream);
+		adapter.mux_upstream = -1;
+	}
+
+	l_hashmap_foreach(adapter.pipes, pipe_collect, list);
+	l_queue_destroy(list, settings.store_frames ? pipe_lost_unref :
+			pipe_disconnect_unref);
+}
+
+static void pipe_release_held(struct idle_pipe *pipe);
+
+/* Multiplexed connection ready: knotd learns about the peer */
+static void pipe_mux_open(struct idle_pipe *pipe)
+{
+	mux_open(pipe->addr.address.uint64);
+	pipe->connecting = false;
+	pipe_release_held(pipe);
+}
+
+static void pipe_mux_open_unref(void *data)
+{
+	struct idle_pipe *pipe = data;
+
+	/* Released meanwhile, or knotd lost and waiting for its grace */
+	if (l_hashmap_lookup(adapter.pipes, &pipe->addr) == pipe &&
+				pipe->connecting && !pipe->grace)
+		pipe_mux_open(pipe);
+
+	idle_pipe_unref(pipe);
+}
+
+/* Connected and rings set up: peers paged meanwhile are opened */
+static void mux_ready(void *user_data)
+{
+	struct l_queue *list;
+
+	adapter.mux_upstream = -1;
+
+	if (adapter.storing)
+		return;
+
+	list = l_queue_new();
+	l_hashmap_foreach(adapter.pipes, pipe_collect, list);
+	l_queue_destroy(list, pipe_mux_open_unref);
+}
+
+/*
+ * Upper layer socket: knotd, shared by every peer. Never blocks: peers
+ * are opened by mux_ready() once connected, their frames held until then.
+ */
+static int mux_connect(void)
+{
+	int sock, upstream, err;
+
+	if (mux_is_running())
+		return 0;
+
+	sock = knotd_connect(true, &upstream);
+	if (sock < 0)
+		return sock;
+
+	/*
+	 * TCP is a byte stream: frames are reassembled. Co-located knotd:
+	 * frames go through shared memory rings.
+	 */
+	err = mux_start(sock, settings.host != NULL,
+			settings.host ? 0 : settings.shm_slots, mux_ready,
+			mux_data, mux_closed, mux_disconnected, NULL);
+	if (err < 0)
+		return err;
+
+	adapter.mux_upstream = upstream;
+
+	return 0;
+}
+
+/* Releases the radio pipe of an online peer, keeping knotd connection */
+static void pipe_park(struct idle_pipe *pipe)
+{
+	char mac_str[24];
+
+	nrf24_mac2str(&pipe->addr, mac_str);
+	hal_log_info("Parking %s", mac_str);
+
+	pipe_detach(pipe);
+}
+
+/*
+ * Least recently active online pipe search: paging pipes are never
+ * parked or evicted.
+ */
+struct pipe_lru {
+	uint32_t timestamp;
+	bool parked;		/* Search parked or attached pipes */
+	struct idle_pipe *pipe;
+	uint32_t idle;		/* Idle time of the pipe found */
+};
+
+static void pipe_lru_update(struct idle_pipe *pipe, struct pipe_lru *lru)
+{
+	uint32_t idle;
+
+	if ((pipe->rxsock < 0) != lru->parked)
+		return;
+
+	if (!device_in_state(&pipe->addr, DEVICE_ONLINE))
+		return;
+
+	idle = lru->timestamp - pipe->timestamp;
+	if (!lru->pipe || idle > lru->idle) {
+		lru->pipe = pipe;
+		lru->idle = idle;
+	}
+}
+
+static void pipe_lru_foreach(const void *key, void *value, void *user_data)
+{
+	pipe_lru_update(value, user_data);
+}
+
+/* Gets a radio socket for a pipe, parking another peer if required */
+static int pipe_attach(struct idle_pipe *pipe)
+{
+	struct pipe_lru lru = { .timestamp = hal_time_ms() };
+	const struct l_queue_entry *entry;
+	int nsk;
+
+	if (l_queue_length(adapter.idle_list) >= MAX_PIPES) {
+		for (entry = l_queue_get_entries(adapter.idle_list);
+						entry; entry = entry->next)
+			pipe_lru_update(entry->data, &lru);
+
+		if (!lru.pipe)
+			return -EUSERS; /* All pipes are paging */
+
+		pipe_park(lru.pipe);
+	}
+
+	/* Radio socket: nRF24 */
+	nsk = radio_comm_socket(HAL_COMM_PROTO_RAW);
+	if (nsk < 0) {
+		hal_log_error("radio_comm_socket(nRF24): %s(%d)",
+			      strerror(-nsk), -nsk);
+		return nsk;
+	}
+
+	pipe->rxsock = nsk;
+	pipe->timestamp = hal_time_ms();
+	l_queue_push_tail(adapter.idle_list, pipe);
+	l_hashmap_insert(adapter.pipe_socks, L_INT_TO_PTR(nsk), pipe);
+
+	return 0;
+}
+
+/*
+ * Called at adapter_disable(). Idles queued by io_disconnect() or
+ * io_connected() may still hold a reference: nothing left may fire
+ * and reach the adapter containers, freed right after.
+ */
+static void pipe_destroy(void *user_data)
+{
+	struct idle_pipe *pipe = user_data;
+
+	pipe_paging_stop(pipe);
+
+	l_timeout_remove(pipe->tx_retry);
+	pipe->tx_retry = NULL;
+	l_timeout_remove(pipe->grace);
+	pipe->grace = NULL;
+
+	/* Closes txsock: receive cancelled first */
+	uring_recv_free(pipe->recv);
+	pipe->recv = NULL;
+	l_io_destroy(pipe->io);
+	pipe->io = NULL;
+	pipe->txsock = -1;
+
+	coalesce_cancel(adapter.coalesce, pipe);
+
+	idle_pipe_unref(pipe);
+}
+
+/* Log2 histogram: bucket 0 is < 8 ms, the last one is >= 512 ms */
+static void latency_record(uint32_t latency)
+{
+	uint32_t limit = 8;
+	int i;
+
+	for (i = 0; i < LATENCY_BUCKETS - 1 && latency >= limit; i++)
+		limit <<= 1;
+
+	adapter.latency[i]++;
+}
+
+/*
+ * Leaves paging state: online if data has been received, otherwise the
+ * connection attempt failed and the pipe is released.
+ */
+static void radio_pipe_paged(struct idle_pipe *pipe, bool online)
+{
+	struct nrf24_device *device;
+	enum device_state state;
+
+	device = device_lookup(&pipe->addr, &state);
+	if (!device || state != DEVICE_PAGING)
+		return;
+
+	if (!online) {
+		pipe_disconnect(pipe);
+		return;
+	}
+
+	pipe_paging_stop(pipe);
+	latency_record(hal_time_ms() - pipe->paging_start);
+
+	device_set_state(&pipe->addr, DEVICE_ONLINE);
+	device_set_connected(device, true);
+}
+
+/* Fires once if no data arrives within settings.paging_timeout */
+static void pipe_paging_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct idle_pipe *pipe = user_data;
+	char mac_str[24];
+
+	nrf24_mac2str(&pipe->addr, mac_str);
+	hal_log_info("Paging %s: timed out", mac_str);
+
+	radio_pipe_paged(pipe, false);
+}
+
+static void pipe_paging_start(struct idle_pipe *pipe, uint32_t presence)
+{
+	pipe->paging_start = presence;
+	pipe->deadline = l_timeout_create_ms(settings.paging_timeout,
+					     pipe_paging_timeout, pipe, NULL);
+}
+
+/*
+ * Coalescing: frames wait, by reference, for the flush window or for
+ * settings.coalesce_bytes to be pending, whichever comes first.
+ */
+static void pipe_coalesce(struct idle_pipe *pipe, struct frame **frames,
+			  unsigned int count)
+{
+	bool idle = l_queue_isempty(pipe->coalesced);
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		l_queue_push_tail(pipe->coalesced, frame_ref(frames[i]));
+		pipe->coalesced_len += frames[i]->len;
+	}
+
+	/* No flush window: written right away */
+	if (!adapter.coalesce ||
+			pipe->coalesced_len >= settings.coalesce_bytes) {
+		if (!idle)
+			coalesce_cancel(adapter.coalesce, pipe);
+
+		pipe_coalesce_flush(pipe);
+	} else if (idle)
+		coalesce_schedule(adapter.coalesce, pipe);
+}
+
+/*
+ * Forwards a batch of radio frames to knotd in a single syscall. Frames
+ * must not be merged: each one is sent as its own SEQPACKET record.
+ */
+static void pipe_uplink(struct idle_pipe *pipe, struct frame **frames,
+			unsigned int count)
+{
+	struct mmsghdr msgs[RADIO_BATCH_MAX];
+	struct iovec iov[RADIO_BATCH_MAX];
+	unsigned int i;
+	int sent, err;
+
+	/*
+	 * Remote knotd: merging frames is fine on a byte stream, and the
+	 * non-blocking socket may take part of a frame only.
+	 */
+	if (settings.host && !settings.mux) {
+		pipe_coalesce(pipe, frames, count);
+		return;
+	}
+
+	memset(msgs, 0, count * sizeof(*msgs));
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = frames[i]->data;
+		iov[i].iov_len = frames[i]->len;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	if (settings.mux)
+		sent = mux_send(pipe->addr.address.uint64, iov, count);
+	else
+		sent = sendmmsg(pipe->txsock, msgs, count, MSG_NOSIGNAL);
+
+	if (sent < 0) {
+		err = settings.mux ? -sent : errno;
+		hal_log_error("write to knotd: %s(%d)",
+			      strerror(err), err);
+	} else if ((unsigned int) sent < count)
+		hal_log_error("write to knotd: %u frame(s) dropped",
+			      count - sent);
+}
+
+/* Moves the oldest held frame to the spool file, if enabled */
+static int pipe_spill(struct idle_pipe *pipe)
+{
+	struct frame *frame;
+	int err;
+
+	if (!settings.store_dir)
+		return -ENOSPC;
+
+	if (!pipe->spool) {
+		pipe->spool = spool_new(settings.store_dir);
+		if (!pipe->spool)
+			return -EIO;
+	}
+
+	frame = l_queue_peek_head(pipe->uplink);
+	err = spool_append(pipe->spool, frame);
+	if (err < 0)
+		return err;
+
+	frame_unref(l_queue_pop_head(pipe->uplink));
+
+	return 0;
+}
+
+/*
+ * Holds radio frames, by reference, until knotd connection is up. In
+ * store-and-forward mode up to settings.store_frames are kept in memory
+ * and the oldest ones overflow to the spool.
+ */
+static void pipe_hold(struct idle_pipe *pipe, struct frame **frames,
+		      unsigned int count)
+{
+	unsigned int max = settings.store_frames ? settings.store_frames :
+						   PIPE_PENDING_MAX;
+	char mac_str[24];
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (l_queue_length(pipe->uplink) >= max &&
+						pipe_spill(pipe) < 0) {
+			nrf24_mac2str(&pipe->addr, mac_str);
+			hal_log_error("%s connecting: dropping uplink frame",
+				      mac_str);
+			frame_unref(l_queue_pop_head(pipe->uplink));
+		}
+
+		l_queue_push_tail(pipe->uplink, frame_ref(frames[i]));
+	}
+}
+
+struct replay {
+	struct idle_pipe *pipe;
+	struct frame *frames[RADIO_BATCH_MAX];
+	unsigned int count;
+};
+
+static void replay_flush(struct replay *replay)
+{
+	unsigned int i;
+
+	pipe_uplink(replay->pipe, replay->frames, replay->count);
+
+	for (i = 0; i < replay->count; i++)
+		frame_unref(replay->frames[i]);
+
+	replay->count = 0;
+}
+
+static void replay_frame(struct frame *frame, void *user_data)
+{
+	struct replay *replay = user_data;
+
+	replay->frames[replay->count++] = frame;
+	if (replay->count == RADIO_BATCH_MAX)
+		replay_flush(replay);
+}
+
+/* Spooled frames are older than the ones in memory: sent first */
+static void pipe_release_held(struct idle_pipe *pipe)
+{
+	struct frame *frames[RADIO_BATCH_MAX];
+	struct replay replay = { .pipe = pipe };
+	unsigned int count, i;
+	char mac_str[24];
+
+	if (spool_count(pipe->spool)) {
+		nrf24_mac2str(&pipe->addr, mac_str);
+		hal_log_info("%s: replaying %u spooled frame(s)", mac_str,
+			     spool_count(pipe->spool));
+
+		spool_replay(pipe->spool, replay_frame, &replay);
+		if (replay.count)
+			replay_flush(&replay);
+	}
+
+	while (!l_queue_isempty(pipe->uplink)) {
+		for (count = 0; count < RADIO_BATCH_MAX; count++) {
+			frames[count] = l_queue_pop_head(pipe->uplink);
+			if (!frames[count])
+				break;
+		}
+
+		pipe_uplink(pipe, frames, count);
+
+		for (i = 0; i < count; i++)
+			frame_unref(frames[i]);
+	}
+}
+
+/* io_uring: a frame from knotd, copied out of a registered buffer */
+static bool pipe_uring_recv(const void *buffer, size_t len, void *user_data)
+{
+	struct idle_pipe *pipe = user_data;
+	struct frame *frame;
+
+	/* Registered buffers are FRAME_SIZE: never too long */
+	frame = frame_new_copy(buffer, len);
+	if (!frame)
+		return true;
+
+	/* Backpressure: same as io_read() */
+	if (!pipe_downlink(pipe, frame)) {
+		pipe->tx_paused = true;
+		return false;
+	}
+
+	return true;
+}
+
+static void pipe_uring_disconnect(int err, void *user_data)
+{
+	io_disconnect(NULL, user_data);
+}
+
+/* io_uring, if running, takes over reads from knotd on a connected socket */
+static void pipe_uring_start(struct idle_pipe *pipe)
+{
+	pipe->recv = uring_recv_new(pipe->txsock, pipe_uring_recv,
+				    pipe_uring_disconnect, pipe);
+	if (!pipe->recv)
+		return;
+
+	l_io_set_read_handler(pipe->io, NULL, NULL, NULL);
+	l_io_set_disconnect_handler(pipe->io, NULL, NULL, NULL);
+}
+
+/* Socket writable: the non-blocking knotd connect has completed */
+static bool io_connected(struct l_io *io, void *user_data)
+{
+	struct idle_pipe *pipe = user_data;
+	char mac_str[24];
+	int err;
+
+	err = tcp_connected(pipe->txsock);
+	if (err < 0) {
+		nrf24_mac2str(&pipe->addr, mac_str);
+		hal_log_error("%s: knotd connect(): %s(%d)", mac_str,
+			      strerror(-err), -err);
+		resolve_failed(pipe->upstream);
+		l_idle_oneshot(pipe_disconnect_oneshot, idle_pipe_ref(pipe),
+			       pipe_oneshot_destroy);
+		return false;
+	}
+
+	pipe->connecting = false;
+	pipe_uring_start(pipe);
+	pipe_release_held(pipe);
+
+	/* Replay filled the socket: handler replaced, keep it */
+	return pipe->coalesce_blocked;
+}
+
+/* Monitors traffic from knotd: a socket of its own, not multiplexed */
+static void pipe_upstream_set(struct idle_pipe *pipe, int sock, int upstream)
+{
+	pipe->txsock = sock;
+	pipe->upstream = upstream;
+	pipe->io = l_io_new(sock);
+	l_io_set_close_on_destroy(pipe->io, true);
+	l_io_set_read_handler(pipe->io, io_read, pipe, NULL);
+	l_io_set_disconnect_handler(pipe->io, io_disconnect, pipe, NULL);
+
+	/* TCP connect may still be in progress: page the device anyway */
+	pipe->connecting = settings.host != NULL;
+	if (pipe->connecting)
+		l_io_set_write_handler(pipe->io, io_connected, pipe, NULL);
+	else
+		pipe_uring_start(pipe);
+}
+
+/* knotd is back: reconnects a pipe held by an outage, replaying frames */
+static void pipe_upstream_restore(struct idle_pipe *pipe)
+{
+	int sock, upstream = -1;
+	char mac_str[24];
+
+	/* Released meanwhile or connection in progress */
+	if (l_hashmap_lookup(adapter.pipes, &pipe->addr) != pipe ||
+				pipe->io || !pipe->connecting)
+		return;
+
+	if (settings.mux)
+		sock = mux_connect();
+	else
+		sock = pool_take(&upstream);
+
+	if (sock < 0) {
+		nrf24_mac2str(&pipe->addr, mac_str);
+		hal_log_error("%s: knotd connect(): %s(%d)", mac_str,
+			      strerror(-sock), -sock);
+		pipe_disconnect(pipe);
+		return;
+	}
+
+	/* Multiplexed: replayed by mux_ready() if still connecting */
+	if (settings.mux) {
+		if (mux_is_ready())
+			pipe_mux_open(pipe);
+		return;
+	}
+
+	pipe_upstream_set(pipe, sock, upstream);
+
+	/* TCP: replayed once the connect completes */
+	if (!pipe->connecting)
+		pipe_release_held(pipe);
+}
+
+/* Frames remain owned by the caller: held ones take a reference */
+static void radio_pipe_recv(struct idle_pipe *pipe, struct frame **frames,
+			    unsigned int count, uint32_t timestamp)
+{
+	pipe->timestamp = timestamp;
+	if (pipe->connecting)
+		pipe_hold(pipe, frames, count);
+	else
+		pipe_uplink(pipe, frames, count);
+
+	/* Radio link is back: deliver what knotd sent while parked */
+	if (!l_queue_isempty(pipe->pending))
+		pipe_flush(pipe);
+	/*
+	 * FIXME: MGMT should be extended to notify connection
+	 * complete event for host initiated connection.
+	 */
+	if (pipe->deadline)
+		radio_pipe_paged(pipe, true);
+}
+
+/*
+ * Services one pipe on behalf of the radio scheduler. Returns true if
+ * any data has been received.
+ */
+static bool radio_pipe_read(struct idle_pipe *pipe, uint32_t timestamp)
+{
+	struct frame *frames[RADIO_BATCH_MAX];
+	int count, i;
+	int rx;
+
+	/*
+	 * HAL sockets are not file descriptors: drain up to a batch of
+	 * frames the radio has buffered since the last tick. Leftovers are
+	 * serviced in the next pass, keeping pipes fair to each other.
+	 */
+	for (count = 0; count < settings.batch; count++) {
+		frames[count] = frame_new();
+		rx = radio_comm_read(pipe->rxsock, frames[count]->data,
+				     sizeof(frames[count]->data));
+		if (rx <= 0) {
+			frame_unref(frames[count]);
+			break;
+		}
+
+		frames[count]->len = rx;
+	}
+
+	if (count == 0)
+		return false;
+
+	radio_pipe_recv(pipe, frames, count, timestamp);
+
+	for (i = 0; i < count; i++)
+		frame_unref(frames[i]);
+
+	return true;
+}
+
+static void device_release(struct nrf24_device *device, uint64_t key,
+			   int state, uint32_t ctime);
+
+/*
+ * Unpaired devices are kept for settings.retention after the last
+ * beacon. Beacons only refresh last seen: the wheel entry is moved
+ * forward when it expires, not on every beacon.
+ */
+static void device_expiry_cb(uint64_t key, void *data, void *user_data)
+{
+	struct nrf24_device *device;
+	uint32_t ctime = L_PTR_TO_UINT(user_data);
+	uint32_t expire;
+	struct nrf24_mac addr;
+	char str[24];
+	int state;
+
+	/* Forgotten or created again meanwhile? */
+	device = table_lookup(adapter.devices, key, &state);
+	if (device != data)
+		return;
+
+	if (device_is_paired(device)) {
+		device_release(device, key, state, ctime);
+		return;
+	}
+
+	expire = device_get_last_seen(device) + settings.retention;
+	if ((int32_t) (expire - ctime) > 0) {
+		wheel_add(adapter.expiry, expire, key, device);
+		return;
+	}
+
+	table_remove(adapter.devices, key);
+
+	device_get_address(device, &addr);
+	nrf24_mac2str(&addr, str);
+	hal_log_info("Destroying %p %s", device, str);
+	device_destroy(device);
+}
+
+static void expiry_timeout_cb(struct l_timeout *timeout, void *user_data)
+{
+	uint32_t timestamp = hal_time_ms();
+
+	wheel_advance(adapter.expiry, timestamp, device_expiry_cb,
+		      L_UINT_TO_PTR(timestamp));
+
+	/* Stay idle until the next unpaired device shows up */
+	if (wheel_count(adapter.expiry))
+		l_timeout_modify_ms(timeout, EXPIRY_TICK);
+}
+
+static void device_expiry_add(struct nrf24_device *device,
+			      const struct nrf24_mac *addr, uint32_t expire)
+{
+	/* Idle wheel: catch up with the clock and restart ticking */
+	if (!wheel_count(adapter.expiry)) {
+		wheel_advance(adapter.expiry, hal_time_ms(), NULL, NULL);
+		l_timeout_modify_ms(expiry_timeout, EXPIRY_TICK);
+	}
+
+	wheel_add(adapter.expiry, expire, addr->address.uint64, device);
+}
+
+/*
+ * Lazy devices: stored devices are in-memory records, their D-Bus object
+ * is registered on the first beacon or FindDevice(). With a release
+ * delay it goes away again once the device has been offline and idle
+ * for that long.
+ */
+static int device_materialize(struct nrf24_device *device,
+			      const struct nrf24_mac *addr)
+{
+	int err;
+
+	if (device_is_registered(device))
+		return 0;
+
+	err = device_register(device);
+	if (err < 0)
+		return err;
+
+	if (settings.device_release)
+		device_expiry_add(device, addr,
+				  hal_time_ms() + settings.device_release);
+
+	return 0;
+}
+
+static void device_release(struct nrf24_device *device, uint64_t key,
+			   int state, uint32_t ctime)
+{
+	uint32_t active, expire;
+	struct nrf24_mac addr;
+	char str[24];
+
+	/* Objects kept, or released already: drop the entry */
+	if (!settings.device_release || !device_is_registered(device))
+		return;
+
+	/* Last beacon or registration, whichever is more recent */
+	active = device_get_last_seen(device);
+	if ((int32_t) (device_get_register_time(device) - active) > 0)
+		active = device_get_register_time(device);
+
+	expire = active + settings.device_release;
+	if (state != DEVICE_OFFLINE)
+		expire = ctime + settings.device_release;
+
+	if ((int32_t) (expire - ctime) > 0) {
+		wheel_add(adapter.expiry, expire, key, device);
+		return;
+	}
+
+	device_get_address(device, &addr);
+	nrf24_mac2str(&addr, str);
+	hal_log_info("Releasing %p %s", device, str);
+	device_unregister(device);
+}
+
+struct parked_expiry {
+	uint32_t ctime;
+	struct l_queue *list;
+};
+
+static void parked_foreach(const void *key, void *value, void *user_data)
+{
+	struct idle_pipe *pipe = value;
+	struct parked_expiry *expiry = user_data;
+	char str[24];
+
+	if (pipe->rxsock >= 0)
+		return;
+
+	if (hal_timeout(expiry->ctime, pipe->timestamp, PARKED_TIMEOUT) == 0)
+		return;
+
+	nrf24_mac2str(&pipe->addr, str);
+	hal_log_info("Parked peer %s gone", str);
+	l_queue_push_tail(expiry->list, idle_pipe_ref(pipe));
+}
+
+static void remove_device_oneshot(void *user_data)
+{
+	struct nrf24_device *device = user_data;
+	/*
+	 * Never call at the same loop
+	 * FIXME: Find better approach. Device object
+	 * should not be unregistered at the same loop.
+	 */
+	device_destroy(device);
+}
+
+static void forget_cb(struct nrf24_device *device, void *user_data)
+{
+	struct nrf24_adapter *adapter = user_data;
+	struct idle_pipe *pipe;
+	struct nrf24_mac addr;
+	char mac_str[24];
+
+	device_get_address(device, &addr);
+
+	if (!table_remove(adapter->devices, addr.address.uint64))
+		return;
+
+	pipe = l_hashmap_lookup(adapter->pipes, &addr);
+	if (pipe)
+		pipe_release(pipe);
+
+	nrf24_mac2str(&addr, mac_str);
+	storage_remove_group(settings.nodes_fd, mac_str);
+	l_idle_oneshot(remove_device_oneshot, device, NULL);
+}
+
+/*
+ * Admission control: all logical pipes are taken. Make room by dropping
+ * the least recently active online peer (parked peers first) back to
+ * offline, unless every peer has been active recently.
+ */
+static int pipe_admit(void)
+{
+	struct pipe_lru lru = { .timestamp = hal_time_ms(), .parked = true };
 	char mac_str[24];
 
-	device_get_address(device, &addr);
+	if (l_hashmap_size(adapter.pipes) < MAX_PEERS)
+		return 0;
 
-	if (!l_hashmap_remove(adapter->offline_list, &addr))
-		if (!l_hashmap_foreach_remove(adapter->paging_list,
-					      paging_foreach, device))
-			if (!l_hashmap_foreach_remove(adapter->online_list,
-						      online_foreach, device))
-				return;
+	l_hashmap_foreach(adapter.pipes, pipe_lru_foreach, &lru);
+	if (!lru.pipe) {
+		lru.parked = false;
+		l_hashmap_foreach(adapter.pipes, pipe_lru_foreach, &lru);
+	}
 
-	nrf24_mac2str(&addr, mac_str);
-	storage_remove_group(settings.nodes_fd, mac_str);
-	l_idle_oneshot(remove_device_oneshot, device, NULL);
+	if (!lru.pipe || lru.idle < EVICT_IDLE_MIN) {
+		adapter.rejections++;
+		return -EUSERS; /* MAX PEERS: No room for more connection */
+	}
+
+	nrf24_mac2str(&lru.pipe->addr, mac_str);
+	hal_log_info("Evicting %s: idle for %u ms", mac_str, lru.idle);
+
+	adapter.evictions++;
+	pipe_disconnect(lru.pipe);
+
+	return 0;
 }
 
 static void evt_disconnected(struct mgmt_nrf24_header *mhdr)
 {
-	struct nrf24_device *device;
 	struct idle_pipe *pipe;
 	char mac_str[24];
 	struct mgmt_evt_nrf24_disconnected *evt =
@@ -461,34 +1736,24 @@ static void evt_disconnected(struct mgmt_nrf24_header *mhdr)
 
 	hal_log_info("Peer disconnected(%s)", mac_str);
 
-	pipe = l_queue_remove_if(adapter.idle_list, pipe_match_addr, &evt->mac);
-	if (!pipe)
+	/* Parked peers are already off the radio */
+	pipe = l_hashmap_lookup(adapter.pipes, &evt->mac);
+	if (!pipe || pipe->rxsock < 0)
 		return;
 
-	/* Move from online to offline */
-	device = l_hashmap_remove(adapter.online_list,
-				  L_INT_TO_PTR(pipe->rxsock));
-	/* Remove & destroy idle */
-	l_idle_remove(pipe->idle);
-	pipe->idle = NULL;
-
-	idle_pipe_unref(pipe);
-
-	if (!device) {
-		/* Connection might be in progress */
-		device = l_hashmap_remove(adapter.paging_list, &evt->mac);
-		if (!device)
-			return;
+	/* Online: keep knotd connection until the peer beacons again */
+	if (device_in_state(&evt->mac, DEVICE_ONLINE)) {
+		pipe_park(pipe);
+		return;
 	}
 
-	l_hashmap_insert(adapter.offline_list, &evt->mac, device);
-	device_set_connected(device, false);
+	pipe_disconnect(pipe);
 }
 
 static int8_t evt_presence(struct mgmt_nrf24_header *mhdr, ssize_t rbytes)
 {
-	struct l_io *io;
-	int sock, nsk;
+	int sock, nsk, err;
+	int upstream = -1;
 	char mac_str[24];
 	const char *end;
 	char *name;
@@ -498,24 +1763,32 @@ static int8_t evt_presence(struct mgmt_nrf24_header *mhdr, ssize_t rbytes)
 	struct mgmt_evt_nrf24_bcast_presence *evt =
 			(struct mgmt_evt_nrf24_bcast_presence *) mhdr->payload;
 	ssize_t name_len;
+	enum device_state state;
 
 	/*
 	 * Paired device: Read from storage, connect automatically.
 	 * Unknown device: Register/Create the device and wait the user
 	 * to trigger 'Pair' method.
 	 */
-	if (l_hashmap_size(adapter.online_list) == MAX_PEERS)
-		return -EUSERS; /* MAX PEERS: No room for more connection */
 
-	/* Connection in progress or quick remote initiated disconnection ? */
-	pipe = l_queue_find(adapter.idle_list, pipe_match_addr, &evt->mac);
+	/*
+	 * Connection in progress or quick remote initiated disconnection?
+	 * Online to knotd but parked: time-share a radio pipe.
+	 */
+	pipe = l_hashmap_lookup(adapter.pipes, &evt->mac);
 	if (pipe) {
+		if (pipe->rxsock < 0) {
+			err = pipe_attach(pipe);
+			if (err < 0)
+				return err;
+		}
+
 		nsk = pipe->rxsock;
 		goto connect_again;
 	}
 
 	/* Register not paired/unknown devices */
-	device = l_hashmap_lookup(adapter.offline_list, &evt->mac);
+	device = device_lookup(&evt->mac, &state);
 	if (!device) {
 		/*
 		 * Calculating the size of the name correctly: rbytes contains the
@@ -543,80 +1816,92 @@ static int8_t evt_presence(struct mgmt_nrf24_header *mhdr, ssize_t rbytes)
 		}
 
 		device_set_last_seen(device, hal_time_ms());
-		l_hashmap_insert(adapter.offline_list, &evt->mac, device);
+		table_insert(adapter.devices, evt->mac.address.uint64, device,
+			     DEVICE_OFFLINE);
+		device_expiry_add(device, &evt->mac,
+				  device_get_last_seen(device) +
+				  settings.retention);
 
 		return 0;
 	}
 
 	device_set_last_seen(device, hal_time_ms());
 
+	err = device_materialize(device, &evt->mac);
+	if (err < 0) {
+		nrf24_mac2str(&evt->mac, mac_str);
+		hal_log_error("Can't register device %s", mac_str);
+	}
+
+	/* Paging or online devices own a pipe: nothing to do here */
+	if (state != DEVICE_OFFLINE)
+		return 0;
+
 	/* Paired/Known device? */
 	if (!device_is_paired(device))
 		return 0;
 
-	/* Radio socket: nRF24 */
-	nsk = hal_comm_socket(HAL_COMM_PF_NRF24, HAL_COMM_PROTO_RAW);
-	if (nsk < 0) {
-		hal_log_error("hal_comm_socket(nRF24): %s(%d)",
-			      strerror(nsk), nsk);
-		return nsk;
-	}
+	err = pipe_admit();
+	if (err < 0)
+		return err;
 
-	/* Upper layer socket: knotd */
-	if (inet_address.s_addr)
-		sock = tcp_connect();
+	/* Upper layer socket: knotd, shared by all peers if multiplexed */
+	if (adapter.storing)
+		sock = -1;	/* knotd unavailable: connects on resume */
+	else if (settings.mux)
+		sock = mux_connect();
 	else
-		sock = unix_connect();
+		sock = pool_take(&upstream);
 
-	if (sock < 0) {
-		hal_log_error("connect(): %s(%d)", strerror(sock), sock);
-		hal_comm_close(nsk);
+	if (sock < 0 && !adapter.storing) {
+		hal_log_error("connect(): %s(%d)", strerror(-sock), -sock);
 		return sock;
 	}
 
-	/* Monitor traffic from knotd */
-	io = l_io_new(sock);
-	l_io_set_close_on_destroy(io, true);
-	l_io_set_read_handler(io, io_read, L_INT_TO_PTR(nsk), io_destroy);
-
-	/* Monitor traffic from radio */
 	pipe = l_new(struct idle_pipe, 1);
 	pipe->refs = 0;
-	pipe->rxsock = nsk; /* Radio */
-	pipe->txsock = sock; /* knotd */
+	pipe->rxsock = -1;
+	pipe->txsock = -1;
+	pipe->upstream = -1;
 	pipe->addr = evt->mac;
-	pipe->timestamp = hal_time_ms();
-	pipe->idle = l_idle_create(radio_idle_read, idle_pipe_ref(pipe),
-				   radio_idle_destroy);
-	l_queue_push_head(adapter.idle_list, idle_pipe_ref(pipe));
+	pipe->pending = l_queue_new();
+	pipe->uplink = l_queue_new();
+	pipe->coalesced = l_queue_new();
+
+	/* Outage or knotd still connecting: page anyway, frames are held */
+	pipe->connecting = adapter.storing ||
+				(settings.mux && !mux_is_ready());
+
+	/* Monitor traffic from knotd */
+	if (!settings.mux && !adapter.storing)
+		pipe_upstream_set(pipe, sock, upstream);
+
+	/* Monitor traffic from radio */
+	err = pipe_attach(pipe);
+	if (err < 0) {
+		idle_pipe_free(pipe);
+		return err;
+	}
+
+	nsk = pipe->rxsock;
+	l_hashmap_insert(adapter.pipes, &pipe->addr, idle_pipe_ref(pipe));
+
+	device_set_state(&evt->mac, DEVICE_PAGING);
+	pipe_paging_start(pipe, device_get_last_seen(device));
 
-	l_hashmap_remove(adapter.offline_list, &evt->mac);
-	l_hashmap_insert(adapter.paging_list, &evt->mac, device);
+	/* Otherwise opened by mux_ready() */
+	if (settings.mux && !pipe->connecting)
+		mux_open(pipe->addr.address.uint64);
 
 connect_again:
 	nrf24_mac2str(&evt->mac, mac_str);
 	hal_log_info("Conneting to %s", mac_str);
 
-	return hal_comm_connect(nsk, &evt->mac.address.uint64);
+	return radio_comm_connect(nsk, &evt->mac.address.uint64);
 }
 
-static void mgmt_idle_read(struct l_idle *idle, void *user_data)
+static void mgmt_event(struct mgmt_nrf24_header *mhdr, ssize_t rbytes)
 {
-	uint8_t buffer[256];
-	struct mgmt_nrf24_header *mhdr = (struct mgmt_nrf24_header *) buffer;
-	ssize_t rbytes;
-
-	memset(buffer, 0x00, sizeof(buffer));
-	rbytes = hal_comm_read(mgmtfd, buffer, sizeof(buffer));
-
-	/* mgmt on bad state? */
-	if (rbytes < 0 && rbytes != -EAGAIN)
-		return;
-
-	/* Nothing to read? */
-	if (rbytes == -EAGAIN)
-		return;
-
 	/* Return/ignore if it is not an event? */
 	if (!(mhdr->opcode & 0x0200))
 		return;
@@ -642,17 +1927,121 @@ static void mgmt_idle_read(struct l_idle *idle, void *user_data)
 	}
 }
 
+static bool mgmt_read(void)
+{
+	uint8_t buffer[256];
+	struct mgmt_nrf24_header *mhdr = (struct mgmt_nrf24_header *) buffer;
+	ssize_t rbytes;
+	int count;
+	bool active = false;
+
+	/* Events are bounded by rbytes: no need to clear the buffer */
+	for (count = 0; count < settings.batch; count++) {
+		rbytes = radio_comm_read(mgmtfd, buffer, sizeof(buffer));
+
+		/* Nothing to read or mgmt on bad state? */
+		if (rbytes <= 0)
+			break;
+
+		mgmt_event(mhdr, rbytes);
+		active = true;
+	}
+
+	return active;
+}
+
+/*
+ * Radio scheduler: services the mgmt socket and every pipe in a single
+ * pass, then sleeps. The sleep interval doubles on each pass where the
+ * radio was silent (up to RADIO_POLL_MAX) and drops back to
+ * RADIO_POLL_MIN as soon as any socket delivers data.
+ */
+static void radio_poll_cb(struct l_timeout *timeout, void *user_data)
+{
+	const struct l_queue_entry *entry;
+	const struct l_queue_entry *next;
+	uint32_t timestamp;
+	bool active;
+
+	/* Radio thread reads the sockets: nothing left to poll */
+	if (radio_thread_is_running())
+		return;
+
+	/* mgmt events may add or remove pipes: run before the pipe pass */
+	active = mgmt_read();
+
+	timestamp = hal_time_ms();
+	for (entry = l_queue_get_entries(adapter.idle_list);
+						entry; entry = next) {
+		/* Current entry may be released while servicing it */
+		next = entry->next;
+		if (radio_pipe_read(entry->data, timestamp))
+			active = true;
+	}
+
+	if (active)
+		radio_poll_interval = RADIO_POLL_MIN;
+	else if (radio_poll_interval < RADIO_POLL_MAX)
+		radio_poll_interval <<= 1;
+
+	l_timeout_modify_ms(timeout, radio_poll_interval);
+}
+
 static void mgmt_timeout_cb(struct l_timeout *timeout, void *user_data)
 {
-	uint32_t timestamp = hal_time_ms();
+	struct parked_expiry expiry = { .ctime = hal_time_ms() };
 
-	l_hashmap_foreach_remove(adapter.offline_list,
-					    offline_foreach,
-					    L_UINT_TO_PTR(timestamp));
+	/*
+	 * Regular teardown: CLOSE sent to knotd if multiplexed, coalesced
+	 * frames flushed. Not from the foreach: it removes the pipe.
+	 */
+	expiry.list = l_queue_new();
+	l_hashmap_foreach(adapter.pipes, parked_foreach, &expiry);
+	l_queue_destroy(expiry.list, pipe_disconnect_unref);
 
 	l_timeout_modify(mgmt_timeout, 5);
 }
 
+/* Head frame written by the radio thread: called from the main loop */
+static void radio_thread_written(int sock, ssize_t ret, void *user_data)
+{
+	struct idle_pipe *pipe;
+
+	pipe = l_hashmap_lookup(adapter.pipe_socks, L_INT_TO_PTR(sock));
+	if (!pipe || !pipe->tx_inflight)
+		return;
+
+	pipe->tx_inflight = false;
+	pipe_tx_done(pipe, ret);
+	pipe_flush(pipe);
+}
+
+/* Frames received by the radio thread: called from the main loop */
+static void radio_thread_frame(int sock, const void *buffer, size_t len,
+			       void *user_data)
+{
+	struct idle_pipe *pipe;
+	struct frame *frame;
+
+	if (sock == mgmtfd) {
+		mgmt_event((struct mgmt_nrf24_header *) buffer, len);
+		return;
+	}
+
+	/* Socket might have been closed after the frame was queued */
+	pipe = l_hashmap_lookup(adapter.pipe_socks, L_INT_TO_PTR(sock));
+	if (!pipe)
+		return;
+
+	/* Ring slots are recycled by the thread: copied once */
+	frame = frame_new_copy(buffer, len);
+	if (!frame)
+		return;
+
+	radio_pipe_recv(pipe, &frame, 1, hal_time_ms());
+	frame_unref(frame);
+}
+
 static int radio_init(uint8_t channel, const struct nrf24_mac *addr)
 {
 	const struct nrf24_config config = {
@@ -667,7 +2056,7 @@ static int radio_init(uint8_t channel, const struct nrf24_mac *addr)
 		return err;
 	}
 
-	mgmtfd = hal_comm_socket(HAL_COMM_PF_NRF24, HAL_COMM_PROTO_MGMT);
+	mgmtfd = radio_comm_socket(HAL_COMM_PROTO_MGMT);
 	if (mgmtfd < 0) {
 		err = mgmtfd;
 		hal_log_error("Cannot create socket for radio (%d)", err);
@@ -686,7 +2075,7 @@ done:
 static void radio_stop(void)
 {
 	/* TODO: disconnect clients */
-	hal_comm_close(mgmtfd);
+	radio_comm_close(mgmtfd);
 
 	hal_comm_deinit();
 }
@@ -699,12 +2088,13 @@ static struct l_dbus_message *method_add_device(struct l_dbus *dbus,
 	struct l_dbus_message_iter value;
 	struct nrf24_adapter *adapter = user_data;
 	struct nrf24_device *device;
+	struct storage_txn *txn;
 	struct nrf24_mac addr;
 	const char *mac_str = NULL;
 	const char *name = NULL;
 	const char *id = NULL;
 	char id16[] = "0000000000000000";
-	int id_len;
+	int id_len, err;
 	char *key;
 
 	if (!l_dbus_message_get_arguments(msg, "a{sv}", &dict))
@@ -734,19 +2124,63 @@ static struct l_dbus_message *method_add_device(struct l_dbus *dbus,
 	/* Padding '0' if id len is smaller 16 chars */
 	memcpy(&id16[strlen(id16) - id_len], id, id_len);
 
+	/* Lazy devices: known without a D-Bus object */
+	if (device_lookup(&addr, NULL))
+		return dbus_error_already_exists(msg);
+
+	/* Stored first: a device that can't be saved is not added */
+	txn = storage_begin(settings.nodes_fd);
+	if (!txn)
+		return dbus_error_failed(msg, strerror(EIO));
+
+	storage_txn_set_string(txn, mac_str, "Name", name);
+	storage_txn_set_string(txn, mac_str, "Id", id);
+	err = storage_commit(txn);
+	if (err < 0) {
+		hal_log_error("Can't store device %s: %s(%d)", mac_str,
+			      strerror(-err), -err);
+		return dbus_error_failed(msg, strerror(-err));
+	}
+
 	device = device_create(adapter->path, &addr, id16, name, true,
 			       forget_cb, adapter);
-	if (!device)
+	if (!device) {
+		storage_remove_group(settings.nodes_fd, mac_str);
 		return dbus_error_invalid_args(msg);
+	}
 
-	storage_write_key_string(settings.nodes_fd, mac_str, "Name", name);
-	storage_write_key_string(settings.nodes_fd, mac_str, "Id", id);
-
-	l_hashmap_insert(adapter->offline_list, &addr, device);
+	table_insert(adapter->devices, addr.address.uint64, device,
+		     DEVICE_OFFLINE);
 
 	return l_dbus_message_new_method_return(msg);
 }
 
+/* Lazy devices: registers the object of a known device if needed */
+static struct l_dbus_message *method_find_device(struct l_dbus *dbus,
+						 struct l_dbus_message *msg,
+						 void *user_data)
+{
+	struct nrf24_device *device;
+	struct l_dbus_message *reply;
+	struct nrf24_mac addr;
+	const char *mac_str;
+
+	if (!l_dbus_message_get_arguments(msg, "s", &mac_str))
+		return dbus_error_invalid_args(msg);
+
+	if (nrf24_str2mac(mac_str, &addr) != 0)
+		return dbus_error_invalid_args(msg);
+
+	device = device_lookup(&addr, NULL);
+	if (!device || device_materialize(device, &addr) < 0)
+		return dbus_error_not_available(msg);
+
+	reply = l_dbus_message_new_method_return(msg);
+	l_dbus_message_set_arguments(reply, "o", device_get_path(device));
+
+	return reply;
+}
+
 static bool property_get_powered(struct l_dbus *dbus,
 				     struct l_dbus_message *msg,
 				     struct l_dbus_message_builder *builder,
@@ -777,12 +2211,120 @@ static bool property_get_address(struct l_dbus *dbus,
 	return true;
 }
 
+static bool property_get_evictions(struct l_dbus *dbus,
+				   struct l_dbus_message *msg,
+				   struct l_dbus_message_builder *builder,
+				   void *user_data)
+{
+	struct nrf24_adapter *adapter = user_data;
+
+	l_dbus_message_builder_append_basic(builder, 'u', &adapter->evictions);
+
+	return true;
+}
+
+static bool property_get_rejections(struct l_dbus *dbus,
+				    struct l_dbus_message *msg,
+				    struct l_dbus_message_builder *builder,
+				    void *user_data)
+{
+	struct nrf24_adapter *adapter = user_data;
+
+	l_dbus_message_builder_append_basic(builder, 'u',
+					    &adapter->rejections);
+
+	return true;
+}
+
+static bool property_get_connect_latency(struct l_dbus *dbus,
+					 struct l_dbus_message *msg,
+					 struct l_dbus_message_builder *builder,
+					 void *user_data)
+{
+	struct nrf24_adapter *adapter = user_data;
+	int i;
+
+	l_dbus_message_builder_enter_array(builder, "u");
+	for (i = 0; i < LATENCY_BUCKETS; i++)
+		l_dbus_message_builder_append_basic(builder, 'u',
+						    &adapter->latency[i]);
+	l_dbus_message_builder_leave_array(builder);
+
+	return true;
+}
+
+static bool property_get_pool_size(struct l_dbus *dbus,
+				   struct l_dbus_message *msg,
+				   struct l_dbus_message_builder *builder,
+				   void *user_data)
+{
+	struct nrf24_adapter *adapter = user_data;
+	uint32_t size = l_queue_length(adapter->pool);
+
+	l_dbus_message_builder_append_basic(builder, 'u', &size);
+
+	return true;
+}
+
+static bool property_get_pool_hits(struct l_dbus *dbus,
+				   struct l_dbus_message *msg,
+				   struct l_dbus_message_builder *builder,
+				   void *user_data)
+{
+	struct nrf24_adapter *adapter = user_data;
+
+	l_dbus_message_builder_append_basic(builder, 'u', &adapter->pool_hits);
+
+	return true;
+}
+
+static bool property_get_pool_misses(struct l_dbus *dbus,
+				     struct l_dbus_message *msg,
+				     struct l_dbus_message_builder *builder,
+				     void *user_data)
+{
+	struct nrf24_adapter *adapter = user_data;
+
+	l_dbus_message_builder_append_basic(builder, 'u',
+					    &adapter->pool_misses);
+
+	return true;
+}
+
+static bool property_get_frame_allocs(struct l_dbus *dbus,
+				      struct l_dbus_message *msg,
+				      struct l_dbus_message_builder *builder,
+				      void *user_data)
+{
+	const struct frame_stats *stats = frame_get_stats();
+
+	l_dbus_message_builder_append_basic(builder, 'u', &stats->allocs);
+
+	return true;
+}
+
+static bool property_get_frame_copies(struct l_dbus *dbus,
+				      struct l_dbus_message *msg,
+				      struct l_dbus_message_builder *builder,
+				      void *user_data)
+{
+	const struct frame_stats *stats = frame_get_stats();
+
+	l_dbus_message_builder_append_basic(builder, 'u', &stats->copies);
+
+	return true;
+}
+
 static void adapter_setup_interface(struct l_dbus_interface *interface)
 {
 
 	l_dbus_interface_method(interface, "AddDevice", 0,
 				method_add_device, "", "a{sv}", "dict");
 
+	l_dbus_interface_method(interface, "FindDevice", 0,
+				method_find_device, "o", "s", "path",
+				"address");
+
 	if (!l_dbus_interface_property(interface, "Powered", 0, "b",
 				       property_get_powered,
 				       NULL))
@@ -792,6 +2334,46 @@ static void adapter_setup_interface(struct l_dbus_interface *interface)
 				       property_get_address,
 				       NULL))
 		hal_log_error("Can't add 'Address' property");
+
+	if (!l_dbus_interface_property(interface, "Evictions", 0, "u",
+				       property_get_evictions,
+				       NULL))
+		hal_log_error("Can't add 'Evictions' property");
+
+	if (!l_dbus_interface_property(interface, "Rejections", 0, "u",
+				       property_get_rejections,
+				       NULL))
+		hal_log_error("Can't add 'Rejections' property");
+
+	if (!l_dbus_interface_property(interface, "ConnectLatency", 0, "au",
+				       property_get_connect_latency,
+				       NULL))
+		hal_log_error("Can't add 'ConnectLatency' property");
+
+	if (!l_dbus_interface_property(interface, "PoolSize", 0, "u",
+				       property_get_pool_size,
+				       NULL))
+		hal_log_error("Can't add 'PoolSize' property");
+
+	if (!l_dbus_interface_property(interface, "PoolHits", 0, "u",
+				       property_get_pool_hits,
+				       NULL))
+		hal_log_error("Can't add 'PoolHits' property");
+
+	if (!l_dbus_interface_property(interface, "PoolMisses", 0, "u",
+				       property_get_pool_misses,
+				       NULL))
+		hal_log_error("Can't add 'PoolMisses' property");
+
+	if (!l_dbus_interface_property(interface, "FrameAllocations", 0, "u",
+				       property_get_frame_allocs,
+				       NULL))
+		hal_log_error("Can't add 'FrameAllocations' property");
+
+	if (!l_dbus_interface_property(interface, "FrameCopies", 0, "u",
+				       property_get_frame_copies,
+				       NULL))
+		hal_log_error("Can't add 'FrameCopies' property");
 }
 
 static void register_device(const char *mac, const char *id,
@@ -803,13 +2385,40 @@ static void register_device(const char *mac, const char *id,
 
 	nrf24_str2mac(mac, &addr);
 
-	/* Registering paired devices */
-	device = device_create(adapter->path, &addr, id, name, true, forget_cb,
-			       adapter);
+	/* Registering paired devices, lazily: see device_materialize() */
+	if (settings.lazy_devices)
+		device = device_new(adapter->path, &addr, id, name, true,
+				    forget_cb, adapter);
+	else
+		device = device_create(adapter->path, &addr, id, name, true,
+				       forget_cb, adapter);
 	if (!device)
 		return;
 
-	l_hashmap_insert(adapter->offline_list, &addr, device);
+	table_insert(adapter->devices, addr.address.uint64, device,
+		     DEVICE_OFFLINE);
+}
+
+/*
+ * The binary database avoids parsing the store at startup. Once parsed,
+ * the store is read instead: it may hold changes not written yet.
+ */
+static void register_devices(void)
+{
+	struct nodedb *db;
+
+	if (settings.nodedb_filename &&
+			!storage_is_loaded(settings.nodes_fd)) {
+		db = nodedb_load(settings.nodedb_filename, settings.nodes_fd);
+		if (db) {
+			nodedb_foreach(db, register_device, &adapter);
+			nodedb_close(db);
+			return;
+		}
+	}
+
+	storage_foreach_nrf24_keys(settings.nodes_fd,
+				   register_device, &adapter);
 }
 
 int adapter_start(const struct nrf24_mac *mac)
@@ -817,18 +2426,28 @@ int adapter_start(const struct nrf24_mac *mac)
 	const char *path = "/nrf0";
 	int ret;
 
-	/*  TCP development mode: RPi(nrfd) connected to Linux(knotd) */
+	/*
+	 * TCP development mode: RPi(nrfd) connected to Linux(knotd).
+	 * Resolved in the background: startup never waits for DNS.
+	 */
 	if (settings.host) {
-		memset(&inet_address, 0, sizeof(inet_address));
-		ret = tcp_init(settings.host);
+		ret = resolve_start(settings.host, settings.port,
+				    settings.resolve_ttl);
 		if (ret < 0)
 			return ret;
-
-		tcp_port = settings.port;
 	}
 
 	memset(&adapter, 0, sizeof(struct nrf24_adapter));
 	adapter.path = l_strdup(path);
+
+	frame_pool_init(FRAME_POOL_INIT);
+
+	/* Optional (--enable-io-uring): l_io reads are the fallback */
+	ret = uring_start(URING_ENTRIES);
+	if (ret < 0 && ret != -ENOTSUP)
+		hal_log_info("io_uring unavailable: %s(%d)", strerror(-ret),
+			     -ret);
+
 	adapter.addr = *mac;
 	adapter.powered = true;
 
@@ -839,17 +2458,18 @@ int adapter_enable(void)
 {
 	adapter.powered = true;
 	adapter.idle_list = l_queue_new();
-	adapter.online_list = l_hashmap_new();
-	adapter.offline_list = l_hashmap_new();
-	adapter.paging_list = l_hashmap_new();
-	l_hashmap_set_hash_function(adapter.offline_list, nrf24_mac_hash);
-	l_hashmap_set_hash_function(adapter.paging_list, nrf24_mac_hash);
-	l_hashmap_set_compare_function(adapter.offline_list, nrf24_mac_compare);
-	l_hashmap_set_compare_function(adapter.paging_list, nrf24_mac_compare);
-	l_hashmap_set_key_copy_function(adapter.offline_list, nrf24_dup);
-	l_hashmap_set_key_copy_function(adapter.paging_list, nrf24_dup);
-	l_hashmap_set_key_free_function(adapter.offline_list, nrf24_destroy);
-	l_hashmap_set_key_free_function(adapter.paging_list, nrf24_destroy);
+	adapter.pipe_socks = l_hashmap_new();
+	adapter.pipes = l_hashmap_new();
+	l_hashmap_set_hash_function(adapter.pipes, nrf24_mac_hash);
+	l_hashmap_set_compare_function(adapter.pipes, nrf24_mac_compare);
+	adapter.devices = table_new();
+	adapter.expiry = wheel_new(hal_time_ms(), EXPIRY_TICK);
+	adapter.pool = l_queue_new();
+
+	/* SEQPACKET records and multiplexed frames are never merged */
+	if (settings.coalesce_window && settings.host && !settings.mux)
+		adapter.coalesce = coalesce_new(settings.coalesce_window,
+						pipe_coalesce_expired, NULL);
 
 	/* nRF24 Adapter object */
 	if (!l_dbus_register_interface(dbus_get_bus(),
@@ -875,11 +2495,22 @@ int adapter_enable(void)
 	/* Register device interface */
 	device_start();
 
-	storage_foreach_nrf24_keys(settings.nodes_fd,
-				   register_device, &adapter);
+	register_devices();
+
+	pool_schedule();
 
-	mgmt_idle = l_idle_create(mgmt_idle_read, NULL, NULL);
+	/* Falls back to the main loop scheduler if the thread can't start */
+	if (settings.radio_thread)
+		radio_thread_start(mgmtfd, settings.batch,
+				   radio_thread_frame, radio_thread_written,
+				   NULL);
+
+	radio_poll_interval = RADIO_POLL_MIN;
+	radio_poll = l_timeout_create_ms(radio_poll_interval, radio_poll_cb,
+					 NULL, NULL);
 	mgmt_timeout = l_timeout_create(5, mgmt_timeout_cb, NULL, NULL);
+	expiry_timeout = l_timeout_create_ms(EXPIRY_TICK, expiry_timeout_cb,
+					     NULL, NULL);
 
 	return 0;
 }
@@ -887,34 +2518,108 @@ int adapter_enable(void)
 void adapter_disable(void)
 {
 	adapter.powered = false;
+	adapter.storing = false;
 
-	if (mgmt_idle) {
-		l_idle_remove(mgmt_idle);
-		mgmt_idle = NULL;
+	if (radio_poll) {
+		l_timeout_remove(radio_poll);
+		radio_poll = NULL;
 	}
 
+	radio_thread_stop();
+
 	if (mgmt_timeout) {
 		l_timeout_remove(mgmt_timeout);
 		mgmt_timeout = NULL;
 	}
 
+	if (expiry_timeout) {
+		l_timeout_remove(expiry_timeout);
+		expiry_timeout = NULL;
+	}
+
 	l_dbus_unregister_interface(dbus_get_bus(),
 				    ADAPTER_INTERFACE);
 
 	device_stop();
 
-	l_queue_destroy(adapter.idle_list, pipe_destroy);
+	/* Closes the shared knotd connection: no CLOSE frame per peer */
+	mux_stop();
+
+	l_queue_destroy(adapter.pool, pool_destroy);
+	adapter.pool = NULL;
+
+	l_queue_destroy(adapter.idle_list, NULL);
+	adapter.idle_list = NULL;
+	l_hashmap_destroy(adapter.pipe_socks, NULL);
+	adapter.pipe_socks = NULL;
+	l_hashmap_destroy(adapter.pipes, pipe_destroy);
+	adapter.pipes = NULL;
+
+	/* After the pipes: they cancel their flush deadlines */
+	coalesce_free(adapter.coalesce);
+	adapter.coalesce = NULL;
+
+	wheel_free(adapter.expiry);
+	adapter.expiry = NULL;
+	table_free(adapter.devices, (table_destroy_func_t) device_destroy);
+	adapter.devices = NULL;
+}
+
+static void pipe_suspend(const void *key, void *value, void *user_data)
+{
+	pipe_upstream_lost(value);
+}
+
+static void pipe_restore_unref(void *data)
+{
+	pipe_upstream_restore(data);
+	idle_pipe_unref(data);
+}
+
+/*
+ * knotd outage in store-and-forward mode: radio pipes and devices stay
+ * up, knotd sockets are closed and uplink frames are held.
+ */
+void adapter_suspend(void)
+{
+	if (!adapter.powered || adapter.storing)
+		return;
+
+	adapter.storing = true;
+
+	/* Pooled sockets were connected to the knotd that is gone */
+	l_queue_clear(adapter.pool, pool_destroy);
+	mux_stop();
+
+	l_hashmap_foreach(adapter.pipes, pipe_suspend, NULL);
+}
 
-	l_hashmap_destroy(adapter.offline_list,
-			(l_hashmap_destroy_func_t ) device_destroy);
-	l_hashmap_destroy(adapter.paging_list,
-			(l_hashmap_destroy_func_t ) device_destroy);
-	l_hashmap_destroy(adapter.online_list,
-			(l_hashmap_destroy_func_t ) device_destroy);
+/* knotd is back: reconnects every pipe, held frames are sent in order */
+void adapter_resume(void)
+{
+	struct l_queue *list;
+
+	if (!adapter.storing)
+		return;
+
+	adapter.storing = false;
+	pool_schedule();
+
+	list = l_queue_new();
+	l_hashmap_foreach(adapter.pipes, pipe_collect, list);
+	l_queue_destroy(list, pipe_restore_unref);
+}
+
+bool adapter_is_suspended(void)
+{
+	return adapter.storing;
 }
 
 void adapter_stop(void)
 {
+	resolve_stop();
 	radio_stop();
+	uring_stop();
+	frame_pool_cleanup();
 	l_free(adapter.path);
 }
@@ -19,6 +19,13 @@
  *
  */
 
+#define ADAPTER_POOL_DEFAULT		2
+#define ADAPTER_POOL_MAX		16	/* Pre-connected knotd sockets */
+#define ADAPTER_STORE_MAX		4096	/* Uplink frames per device */
+#define ADAPTER_COALESCE_MAX		100000	/* us */
+#define ADAPTER_COALESCE_BYTES		1400	/* Fits an Ethernet segment */
+#define ADAPTER_RELEASE_MAX		86400	/* Seconds: lazy device objects */
+
 struct nrf24_adapter;
 
 int adapter_start(const struct nrf24_mac *mac);
@@ -26,3 +33,7 @@ void adapter_stop(void);
 
 int adapter_enable(void);
 void adapter_disable(void);
+
+void adapter_suspend(void);
+void adapter_resume(void);
+bool adapter_is_suspended(void);
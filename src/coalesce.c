@@ -0,0 +1,182 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include <ell/ell.h>
+
+#include "hal/linux_log.h"
+
+#include "coalesce.h"
+
+struct coalesce_entry {
+	void *data;
+	uint64_t deadline;		/* Monotonic: us */
+};
+
+struct coalesce {
+	int tfd;
+	struct l_io *io;
+	unsigned int window;		/* us */
+	struct l_queue *entries;	/* Ordered by deadline */
+	coalesce_flush_func_t func;
+	void *user_data;
+};
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Absolute expiration: a late arm still fires right away */
+static void coalesce_arm(struct coalesce *coalesce)
+{
+	struct coalesce_entry *entry = l_queue_peek_head(coalesce->entries);
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (entry) {
+		its.it_value.tv_sec = entry->deadline / 1000000;
+		its.it_value.tv_nsec = (entry->deadline % 1000000) * 1000;
+	}
+
+	if (timerfd_settime(coalesce->tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		hal_log_error("coalesce timerfd_settime(): %s(%d)",
+			      strerror(errno), errno);
+}
+
+static bool coalesce_expired(struct l_io *io, void *user_data)
+{
+	struct coalesce *coalesce = user_data;
+	struct coalesce_entry *entry;
+	uint64_t expirations, now;
+
+	if (read(coalesce->tfd, &expirations, sizeof(expirations)) < 0)
+		return true;
+
+	now = now_us();
+
+	/* The callback may cancel or schedule other entries */
+	while ((entry = l_queue_peek_head(coalesce->entries)) &&
+						entry->deadline <= now) {
+		l_queue_pop_head(coalesce->entries);
+		coalesce->func(entry->data, coalesce->user_data);
+		l_free(entry);
+	}
+
+	coalesce_arm(coalesce);
+
+	return true;
+}
+
+struct coalesce *coalesce_new(unsigned int window_us,
+			      coalesce_flush_func_t func, void *user_data)
+{
+	struct coalesce *coalesce;
+	int tfd;
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (tfd < 0) {
+		hal_log_error("coalesce timerfd_create(): %s(%d)",
+			      strerror(errno), errno);
+		return NULL;
+	}
+
+	coalesce = l_new(struct coalesce, 1);
+	coalesce->tfd = tfd;
+	coalesce->window = window_us;
+	coalesce->entries = l_queue_new();
+	coalesce->func = func;
+	coalesce->user_data = user_data;
+
+	coalesce->io = l_io_new(tfd);
+	l_io_set_close_on_destroy(coalesce->io, true);
+	l_io_set_read_handler(coalesce->io, coalesce_expired, coalesce, NULL);
+
+	return coalesce;
+}
+
+/* Pending entries are dropped without being flushed */
+void coalesce_free(struct coalesce *coalesce)
+{
+	if (unlikely(!coalesce))
+		return;
+
+	/* Closes tfd */
+	l_io_destroy(coalesce->io);
+	l_queue_destroy(coalesce->entries, l_free);
+	l_free(coalesce);
+}
+
+/* data is flushed once the window elapses: callers schedule it once */
+void coalesce_schedule(struct coalesce *coalesce, void *data)
+{
+	struct coalesce_entry *entry;
+	bool idle = l_queue_isempty(coalesce->entries);
+
+	entry = l_new(struct coalesce_entry, 1);
+	entry->data = data;
+	entry->deadline = now_us() + coalesce->window;
+	l_queue_push_tail(coalesce->entries, entry);
+
+	if (idle)
+		coalesce_arm(coalesce);
+}
+
+static bool entry_match(const void *a, const void *b)
+{
+	const struct coalesce_entry *entry = a;
+
+	return entry->data == b;
+}
+
+void coalesce_cancel(struct coalesce *coalesce, void *data)
+{
+	struct coalesce_entry *entry;
+
+	if (unlikely(!coalesce))
+		return;
+
+	entry = l_queue_remove_if(coalesce->entries, entry_match, data);
+	if (!entry)
+		return;
+
+	l_free(entry);
+
+	/* Head gone: the timer may fire for nothing, harmless */
+	if (l_queue_isempty(coalesce->entries))
+		coalesce_arm(coalesce);
+}
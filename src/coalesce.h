@@ -0,0 +1,39 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Flush deadlines for upstream frame coalescing. Every entry gets the
+ * same window, so deadlines expire in insertion order: a FIFO and a
+ * single timerfd armed for its head give microsecond resolution for any
+ * number of connections.
+ */
+
+struct coalesce;
+
+typedef void (*coalesce_flush_func_t) (void *data, void *user_data);
+
+struct coalesce *coalesce_new(unsigned int window_us,
+			      coalesce_flush_func_t func, void *user_data);
+void coalesce_free(struct coalesce *coalesce);
+
+void coalesce_schedule(struct coalesce *coalesce, void *data);
+void coalesce_cancel(struct coalesce *coalesce, void *data);
@@ -32,3 +32,5 @@ struct l_dbus_message *dbus_error_already_exists(struct l_dbus_message *msg);
 struct l_dbus_message *dbus_error_busy(struct l_dbus_message *msg);
 struct l_dbus_message *dbus_error_invalid_args( struct l_dbus_message *msg);
 struct l_dbus_message *dbus_error_not_available(struct l_dbus_message *msg);
+struct l_dbus_message *dbus_error_failed(struct l_dbus_message *msg,
+					 const char *str);
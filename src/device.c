@@ -30,6 +30,7 @@
 
 #include "hal/linux_log.h"
 #include "hal/nrf24.h"
+#include "hal/time.h"
 
 #include <ell/ell.h>
 
@@ -42,12 +43,17 @@ struct nrf24_device {
 	struct nrf24_mac addr;
 	int refs;
 	uint32_t last_seen;
+	uint32_t tx_queued;	/* Downlink frames waiting for the radio */
+	uint32_t tx_drops;
+	uint32_t tx_retries;
 	char *id;
 	char *name;
 	char *dpath;		/* Device object path */
 	char *apath;		/* Adapter object path */
 	bool paired;
 	bool connected;
+	bool registered;	/* D-Bus object: see device_register() */
+	uint32_t register_time;
 	device_forget_cb_t forget_cb;
 	void *user_data;
 	struct l_dbus_message *msg;
@@ -97,7 +103,9 @@ static struct l_dbus_message *method_pair(struct l_dbus *dbus,
 						void *user_data)
 {
 	struct nrf24_device *device = user_data;
+	struct storage_txn *txn;
 	char mac_str[24];
+	int err;
 
 	if (device->paired)
 		return dbus_error_already_exists(msg);
@@ -105,6 +113,26 @@ static struct l_dbus_message *method_pair(struct l_dbus *dbus,
 	if (device->msg)
 		return dbus_error_busy(msg);
 
+	if (nrf24_mac2str(&device->addr, mac_str) != 0)
+		return dbus_error_invalid_args(msg);
+
+	/*
+	 * Name without Id would not be loaded back: written together, and
+	 * before pairing. Not paired if it can't be saved.
+	 */
+	txn = storage_begin(settings.nodes_fd);
+	if (!txn)
+		return dbus_error_failed(msg, strerror(EIO));
+
+	storage_txn_set_string(txn, mac_str, "Name", device->name);
+	storage_txn_set_string(txn, mac_str, "Id", device->id);
+	err = storage_commit(txn);
+	if (err < 0) {
+		hal_log_error("Can't store device %s: %s(%d)", mac_str,
+			      strerror(-err), -err);
+		return dbus_error_failed(msg, strerror(-err));
+	}
+
 	device->msg = l_dbus_message_ref(msg);
 	device->paired = true;
 
@@ -115,14 +143,6 @@ static struct l_dbus_message *method_pair(struct l_dbus *dbus,
 	l_dbus_message_unref(device->msg);
 	device->msg = NULL;
 
-	if (nrf24_mac2str(&device->addr, mac_str) != 0)
-		return dbus_error_invalid_args(msg);
-
-	storage_write_key_string(settings.nodes_fd, mac_str,
-				 "Name", device->name);
-	storage_write_key_string(settings.nodes_fd, mac_str,
-				 "Id", device->id);
-
 	return l_dbus_message_new_method_return(msg);
 }
 
@@ -256,6 +276,42 @@ static bool property_get_paired(struct l_dbus *dbus,
 	return true;
 }
 
+static bool property_get_tx_queued(struct l_dbus *dbus,
+				   struct l_dbus_message *msg,
+				   struct l_dbus_message_builder *builder,
+				   void *user_data)
+{
+	struct nrf24_device *device = user_data;
+
+	l_dbus_message_builder_append_basic(builder, 'u', &device->tx_queued);
+
+	return true;
+}
+
+static bool property_get_tx_drops(struct l_dbus *dbus,
+				  struct l_dbus_message *msg,
+				  struct l_dbus_message_builder *builder,
+				  void *user_data)
+{
+	struct nrf24_device *device = user_data;
+
+	l_dbus_message_builder_append_basic(builder, 'u', &device->tx_drops);
+
+	return true;
+}
+
+static bool property_get_tx_retries(struct l_dbus *dbus,
+				    struct l_dbus_message *msg,
+				    struct l_dbus_message_builder *builder,
+				    void *user_data)
+{
+	struct nrf24_device *device = user_data;
+
+	l_dbus_message_builder_append_basic(builder, 'u', &device->tx_retries);
+
+	return true;
+}
+
 static void device_setup_interface(struct l_dbus_interface *interface)
 {
 	l_dbus_interface_method(interface, "Pair", 0,
@@ -293,17 +349,34 @@ static void device_setup_interface(struct l_dbus_interface *interface)
 				       property_get_paired,
 				       NULL))
 		hal_log_error("Can't add 'Paired' property");
+
+	if (!l_dbus_interface_property(interface, "TxQueued", 0, "u",
+				       property_get_tx_queued,
+				       NULL))
+		hal_log_error("Can't add 'TxQueued' property");
+
+	if (!l_dbus_interface_property(interface, "TxDrops", 0, "u",
+				       property_get_tx_drops,
+				       NULL))
+		hal_log_error("Can't add 'TxDrops' property");
+
+	if (!l_dbus_interface_property(interface, "TxRetries", 0, "u",
+				       property_get_tx_retries,
+				       NULL))
+		hal_log_error("Can't add 'TxRetries' property");
 }
 
-struct nrf24_device *device_create(const char *adapter_path,
-				   const struct nrf24_mac *addr,
-				   const char *id, const char *name, bool paired,
-				   device_forget_cb_t forget_cb,
-				   void *user_data)
+/*
+ * In-memory record only: no D-Bus object until device_register(). Lazy
+ * registration keeps large provisioned fleets off the bus.
+ */
+struct nrf24_device *device_new(const char *adapter_path,
+				const struct nrf24_mac *addr,
+				const char *id, const char *name, bool paired,
+				device_forget_cb_t forget_cb, void *user_data)
 {
 	struct nrf24_device *device;
 	char device_path[24 + strlen(adapter_path) + 1];
-	char mac_str[24];
 	int i, len;
 
 	device = l_new(struct nrf24_device, 1);
@@ -315,9 +388,6 @@ struct nrf24_device *device_create(const char *adapter_path,
 	device->forget_cb = forget_cb;
 	device->user_data = user_data;
 
-	memset(mac_str, 0, sizeof(mac_str));
-
-	strcpy(device_path, adapter_path);
 	len = snprintf(device_path, sizeof(device_path), "%s/", adapter_path);
 
 	nrf24_mac2str(addr, &device_path[len]);
@@ -331,27 +401,74 @@ struct nrf24_device *device_create(const char *adapter_path,
 	device->apath = l_strdup(adapter_path);
 	device->dpath = l_strdup(device_path);
 
+	return device_ref(device);
+}
+
+/* Registers the D-Bus object, if not registered yet */
+int device_register(struct nrf24_device *device)
+{
+	if (device->registered)
+		return 0;
+
 	if (!l_dbus_register_object(dbus_get_bus(),
-				    device_path,
+				    device->dpath,
 				    device_ref(device),
 				    (l_dbus_destroy_func_t) device_unref,
 				    DEVICE_INTERFACE, device,
 				    L_DBUS_INTERFACE_PROPERTIES, device,
-				    NULL))
-		goto dev_reg_fail;
-
-	return device_ref(device);
+				    NULL)) {
+		device_unref(device);
+		return -EIO;
+	}
 
-dev_reg_fail:
-	device_free(device);
+	device->registered = true;
+	device->register_time = hal_time_ms();
 
-	return NULL;
+	return 0;
 }
 
-void device_destroy(struct nrf24_device *device)
+/* Back to an in-memory record: the device itself is kept */
+void device_unregister(struct nrf24_device *device)
 {
+	if (!device->registered)
+		return;
+
+	device->registered = false;
 	l_dbus_unregister_object(dbus_get_bus(), device->dpath);
+}
+
+bool device_is_registered(const struct nrf24_device *device)
+{
+	return device->registered;
+}
+
+uint32_t device_get_register_time(const struct nrf24_device *device)
+{
+	return device->register_time;
+}
+
+struct nrf24_device *device_create(const char *adapter_path,
+				   const struct nrf24_mac *addr,
+				   const char *id, const char *name, bool paired,
+				   device_forget_cb_t forget_cb,
+				   void *user_data)
+{
+	struct nrf24_device *device;
+
+	device = device_new(adapter_path, addr, id, name, paired, forget_cb,
+			    user_data);
+
+	if (device_register(device) < 0) {
+		device_unref(device);
+		return NULL;
+	}
+
+	return device;
+}
 
+void device_destroy(struct nrf24_device *device)
+{
+	device_unregister(device);
 	device_unref(device);
 }
 
@@ -377,6 +494,9 @@ void device_set_connected(struct nrf24_device *device, bool connected)
 		return;
 
 	device->connected = connected;
+	if (!device->registered)
+		return;
+
 	l_dbus_property_changed(dbus_get_bus(), device->dpath,
 				DEVICE_INTERFACE,"Connected");
 }
@@ -391,6 +511,21 @@ void device_set_last_seen(struct nrf24_device *device, uint32_t time_seen)
 	device->last_seen = time_seen;
 }
 
+void device_set_tx_queued(struct nrf24_device *device, uint32_t queued)
+{
+	device->tx_queued = queued;
+}
+
+void device_inc_tx_drops(struct nrf24_device *device)
+{
+	device->tx_drops++;
+}
+
+void device_inc_tx_retries(struct nrf24_device *device)
+{
+	device->tx_retries++;
+}
+
 int device_start(void)
 {
 	/* nRF24 Device (device) object */
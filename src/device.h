@@ -37,4 +37,16 @@ struct nrf24_device *device_create(const char *adapter_path,
 				   void *user_data);
 uint32_t device_get_last_seen(struct nrf24_device *device);
 void device_set_last_seen(struct nrf24_device *device, uint32_t time_seen);
+void device_set_tx_queued(struct nrf24_device *device, uint32_t queued);
+void device_inc_tx_drops(struct nrf24_device *device);
+void device_inc_tx_retries(struct nrf24_device *device);
 void device_destroy(struct nrf24_device *device);
+
+struct nrf24_device *device_new(const char *adapter_path,
+				const struct nrf24_mac *addr,
+				const char *id, const char *name, bool paired,
+				device_forget_cb_t forget_cb, void *user_data);
+int device_register(struct nrf24_device *device);
+void device_unregister(struct nrf24_device *device);
+bool device_is_registered(const struct nrf24_device *device);
+uint32_t device_get_register_time(const struct nrf24_device *device);
@@ -0,0 +1,136 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <ell/ell.h>
+
+#include "frame.h"
+
+#define FRAME_POOL_MAX			256	/* Frames kept for reuse */
+
+static struct frame *free_list;
+static unsigned int free_count;
+static struct frame_stats stats;
+
+void frame_pool_init(unsigned int count)
+{
+	struct frame *frame;
+
+	if (count > FRAME_POOL_MAX)
+		count = FRAME_POOL_MAX;
+
+	while (free_count < count) {
+		frame = l_new(struct frame, 1);
+		frame->next = free_list;
+		free_list = frame;
+		free_count++;
+	}
+}
+
+void frame_pool_cleanup(void)
+{
+	struct frame *frame;
+
+	while ((frame = free_list) != NULL) {
+		free_list = frame->next;
+		l_free(frame);
+	}
+
+	free_count = 0;
+}
+
+/* Contents are not cleared: callers write len bytes before use */
+struct frame *frame_new(void)
+{
+	struct frame *frame = free_list;
+
+	if (frame) {
+		free_list = frame->next;
+		free_count--;
+		stats.reuses++;
+	} else {
+		frame = l_malloc(sizeof(*frame));
+		stats.allocs++;
+	}
+
+	frame->refs = 1;
+	frame->len = 0;
+	frame->next = NULL;
+
+	return frame;
+}
+
+/* NULL if len exceeds FRAME_SIZE: a truncated frame is never queued */
+struct frame *frame_new_copy(const void *buffer, size_t len)
+{
+	struct frame *frame;
+
+	if (len > FRAME_SIZE)
+		return NULL;
+
+	frame = frame_new();
+	memcpy(frame->data, buffer, len);
+	frame->len = len;
+	stats.copies++;
+
+	return frame;
+}
+
+struct frame *frame_ref(struct frame *frame)
+{
+	if (unlikely(!frame))
+		return NULL;
+
+	frame->refs++;
+
+	return frame;
+}
+
+void frame_unref(struct frame *frame)
+{
+	if (unlikely(!frame))
+		return;
+
+	if (--frame->refs > 0)
+		return;
+
+	if (free_count >= FRAME_POOL_MAX) {
+		l_free(frame);
+		return;
+	}
+
+	frame->next = free_list;
+	free_list = frame;
+	free_count++;
+}
+
+const struct frame_stats *frame_get_stats(void)
+{
+	return &stats;
+}
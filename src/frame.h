@@ -0,0 +1,52 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Refcounted frame buffers shared by the radio and knotd paths. A frame
+ * is read into once and then passed by reference through queues and
+ * batched writes. Main loop only: not thread safe.
+ */
+
+#define FRAME_SIZE			256
+
+struct frame {
+	int refs;
+	size_t len;
+	struct frame *next;		/* Free list */
+	uint8_t data[FRAME_SIZE];
+};
+
+struct frame_stats {
+	uint32_t allocs;		/* Frames taken from the heap */
+	uint32_t reuses;		/* Frames taken from the pool */
+	uint32_t copies;		/* Frames filled by memcpy */
+};
+
+void frame_pool_init(unsigned int count);
+void frame_pool_cleanup(void);
+
+struct frame *frame_new(void);
+struct frame *frame_new_copy(const void *buffer, size_t len);
+struct frame *frame_ref(struct frame *frame);
+void frame_unref(struct frame *frame);
+
+const struct frame_stats *frame_get_stats(void);
@@ -0,0 +1,705 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#include <ell/ell.h>
+
+#include "hal/linux_log.h"
+
+#include "journal.h"
+
+/*
+ * Files next to the store: the live journal, and the previous one while
+ * (or if a crash happened while) it is being folded into the snapshot.
+ * Replay order is snapshot, rotated journal, live journal.
+ */
+#define JOURNAL_SUFFIX			".journal"
+#define JOURNAL_ROTATED_SUFFIX		".journal.0"
+#define SNAPSHOT_TMP_SUFFIX		".tmp"
+
+/* Little endian, followed by len bytes of operations */
+struct journal_hdr {
+	uint32_t len;
+	uint32_t crc;			/* CRC-32 of the operations */
+} __attribute__ ((packed));
+
+/*
+ * One compaction in flight. The snapshot is written on a detached thread
+ * that signals an eventfd: the main loop keeps appending to the live
+ * journal meanwhile. Shared by the thread and the main loop, the last
+ * one to drop its reference frees it.
+ */
+struct compact_job {
+	int refs;
+	int efd;
+	struct l_io *io;		/* Main loop only: monitors efd */
+	char *snapshot;
+	char *rotated;
+	char *data;
+	size_t len;
+	int err;
+};
+
+struct journal {
+	int fd;
+	char *snapshot;			/* Store file */
+	char *path;			/* Live journal */
+	char *rotated;
+	off_t size;			/* Live journal bytes */
+	uint8_t *buf;			/* Pending records */
+	size_t len;
+	size_t alloc;
+	size_t open;			/* Header of the record being added to */
+	bool adding;
+	struct compact_job *job;
+};
+
+static uint32_t crc32(const uint8_t *data, size_t len)
+{
+	uint32_t crc = 0xffffffff;
+	size_t i;
+	int bit;
+
+	for (i = 0; i < len; i++) {
+		crc ^= data[i];
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+
+	return ~crc;
+}
+
+/* Next NUL terminated string of a record, NULL if malformed */
+static const char *record_string(const uint8_t *body, size_t len,
+				 size_t *off)
+{
+	const char *str = (const char *) body + *off;
+	const uint8_t *end;
+
+	if (*off >= len)
+		return NULL;
+
+	end = memchr(body + *off, '\0', len - *off);
+	if (!end)
+		return NULL;
+
+	*off = end - body + 1;
+
+	return str;
+}
+
+/* Checks the whole record when func is NULL, applies it otherwise */
+static bool record_parse(const uint8_t *body, size_t len,
+			 journal_replay_func_t func, void *user_data)
+{
+	const char *group, *key, *value;
+	size_t off = 0;
+	uint8_t op;
+
+	while (off < len) {
+		op = body[off++];
+		key = NULL;
+		value = NULL;
+
+		group = record_string(body, len, &off);
+		if (!group)
+			return false;
+
+		switch (op) {
+		case JOURNAL_SET:
+			key = record_string(body, len, &off);
+			value = key ? record_string(body, len, &off) : NULL;
+			if (!value)
+				return false;
+			break;
+		case JOURNAL_REMOVE:
+			break;
+		default:
+			return false;
+		}
+
+		if (func)
+			func(op, group, key, value, user_data);
+	}
+
+	return true;
+}
+
+static uint8_t *read_file(int fd, size_t *len)
+{
+	struct stat st;
+	uint8_t *data;
+	size_t off = 0;
+	ssize_t ret;
+
+	if (fstat(fd, &st) < 0)
+		return NULL;
+
+	data = l_malloc(st.st_size ? st.st_size : 1);
+	while (off < (size_t) st.st_size) {
+		ret = pread(fd, data + off, st.st_size - off, off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
+			break;
+
+		off += ret;
+	}
+
+	*len = off;
+
+	return data;
+}
+
+/* Returns the length of the valid prefix, or a negative error */
+static ssize_t replay_file(int fd, journal_replay_func_t func,
+			   void *user_data)
+{
+	struct journal_hdr hdr;
+	uint8_t *data;
+	size_t len, off = 0;
+	uint32_t body;
+
+	data = read_file(fd, &len);
+	if (!data)
+		return -errno;
+
+	while (len - off >= sizeof(hdr)) {
+		memcpy(&hdr, data + off, sizeof(hdr));
+		body = L_LE32_TO_CPU(hdr.len);
+
+		if (body > JOURNAL_RECORD_MAX ||
+				body > len - off - sizeof(hdr))
+			break;
+
+		if (crc32(data + off + sizeof(hdr), body) !=
+						L_LE32_TO_CPU(hdr.crc))
+			break;
+
+		if (!record_parse(data + off + sizeof(hdr), body, NULL, NULL))
+			break;
+
+		record_parse(data + off + sizeof(hdr), body, func, user_data);
+		off += sizeof(hdr) + body;
+	}
+
+	if (off < len)
+		hal_log_error("journal: dropped %zu byte(s) of torn records",
+			      len - off);
+
+	l_free(data);
+
+	return off;
+}
+
+static int replay_path(const char *path, bool live,
+		       journal_replay_func_t func, void *user_data)
+{
+	ssize_t valid;
+	int fd, err = 0;
+
+	fd = open(path, (live ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -errno;
+
+	valid = replay_file(fd, func, user_data);
+	if (valid < 0)
+		err = valid;
+	/* Appending after a torn record would hide every later record */
+	else if (live && ftruncate(fd, valid) < 0)
+		err = -errno;
+
+	close(fd);
+
+	return err;
+}
+
+/* Applies the journals left next to the store at pathname, if any */
+int journal_replay(const char *pathname, journal_replay_func_t func,
+		   void *user_data)
+{
+	char *path;
+	int err;
+
+	path = l_strdup_printf("%s" JOURNAL_ROTATED_SUFFIX, pathname);
+	err = replay_path(path, false, func, user_data);
+	l_free(path);
+	if (err < 0)
+		return err;
+
+	path = l_strdup_printf("%s" JOURNAL_SUFFIX, pathname);
+	err = replay_path(path, true, func, user_data);
+	l_free(path);
+
+	return err;
+}
+
+static uint64_t stamp_file(uint64_t hash, const char *path)
+{
+	struct stat st;
+	uint64_t fields[4] = { 0 };
+	const uint8_t *byte = (const uint8_t *) fields;
+	size_t i;
+
+	if (stat(path, &st) == 0) {
+		fields[0] = st.st_ino;
+		fields[1] = st.st_size;
+		fields[2] = st.st_mtim.tv_sec;
+		fields[3] = st.st_mtim.tv_nsec;
+	}
+
+	/* FNV-1a */
+	for (i = 0; i < sizeof(fields); i++)
+		hash = (hash ^ byte[i]) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+/*
+ * Identifies the on-disk state of the store at pathname: the snapshot
+ * and both journals. Any write or compaction changes it.
+ */
+uint64_t journal_stamp(const char *pathname)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	char *path;
+
+	hash = stamp_file(hash, pathname);
+
+	path = l_strdup_printf("%s" JOURNAL_ROTATED_SUFFIX, pathname);
+	hash = stamp_file(hash, path);
+	l_free(path);
+
+	path = l_strdup_printf("%s" JOURNAL_SUFFIX, pathname);
+	hash = stamp_file(hash, path);
+	l_free(path);
+
+	return hash;
+}
+
+static int open_live(struct journal *journal)
+{
+	struct stat st;
+
+	journal->fd = open(journal->path,
+			   O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+			   S_IRUSR | S_IWUSR);
+	if (journal->fd < 0)
+		return -errno;
+
+	journal->size = fstat(journal->fd, &st) < 0 ? 0 : st.st_size;
+
+	return 0;
+}
+
+/* Appends to the journal of the store at pathname */
+struct journal *journal_open(const char *pathname)
+{
+	struct journal *journal;
+	int err;
+
+	journal = l_new(struct journal, 1);
+	journal->snapshot = l_strdup(pathname);
+	journal->path = l_strdup_printf("%s" JOURNAL_SUFFIX, pathname);
+	journal->rotated = l_strdup_printf("%s" JOURNAL_ROTATED_SUFFIX,
+					   pathname);
+
+	err = open_live(journal);
+	if (err < 0) {
+		hal_log_error("journal %s: %s(%d)", journal->path,
+			      strerror(-err), -err);
+		l_free(journal->rotated);
+		l_free(journal->path);
+		l_free(journal->snapshot);
+		l_free(journal);
+		return NULL;
+	}
+
+	return journal;
+}
+
+static void job_unref(struct compact_job *job)
+{
+	if (__sync_sub_and_fetch(&job->refs, 1))
+		return;
+
+	close(job->efd);
+	l_free(job->data);
+	l_free(job->rotated);
+	l_free(job->snapshot);
+	l_free(job);
+}
+
+/* Main loop reference: the l_io goes first, it refers to efd */
+static void job_release(void *user_data)
+{
+	struct compact_job *job = user_data;
+
+	l_io_destroy(job->io);
+	job->io = NULL;
+	job_unref(job);
+}
+
+/* A compaction in flight completes on its own */
+void journal_close(struct journal *journal)
+{
+	if (unlikely(!journal))
+		return;
+
+	if (journal->job)
+		job_release(journal->job);
+
+	close(journal->fd);
+	l_free(journal->buf);
+	l_free(journal->rotated);
+	l_free(journal->path);
+	l_free(journal->snapshot);
+	l_free(journal);
+}
+
+static void buf_append(struct journal *journal, const void *data,
+		       size_t len)
+{
+	if (journal->len + len > journal->alloc) {
+		journal->alloc = (journal->len + len) * 2;
+		journal->buf = l_realloc(journal->buf, journal->alloc);
+	}
+
+	memcpy(journal->buf + journal->len, data, len);
+	journal->len += len;
+}
+
+/* Bytes op takes in a record: see JOURNAL_RECORD_MAX */
+size_t journal_op_size(enum journal_op op, const char *group,
+		       const char *key, const char *value)
+{
+	size_t size = 1 + strlen(group) + 1;
+
+	if (op == JOURNAL_SET)
+		size += strlen(key) + 1 + strlen(value) + 1;
+
+	return size;
+}
+
+/*
+ * Operations go to the current record, started if needed, until
+ * journal_seal(). The caller keeps a record within JOURNAL_RECORD_MAX.
+ */
+void journal_add(struct journal *journal, enum journal_op op,
+		 const char *group, const char *key, const char *value)
+{
+	struct journal_hdr hdr;
+	char code = op;
+
+	if (!journal->adding) {
+		memset(&hdr, 0, sizeof(hdr));
+		journal->open = journal->len;
+		journal->adding = true;
+		buf_append(journal, &hdr, sizeof(hdr));
+	}
+
+	buf_append(journal, &code, 1);
+	buf_append(journal, group, strlen(group) + 1);
+
+	if (op != JOURNAL_SET)
+		return;
+
+	buf_append(journal, key, strlen(key) + 1);
+	buf_append(journal, value, strlen(value) + 1);
+}
+
+/* Closes the current record: replayed whole or not at all */
+void journal_seal(struct journal *journal)
+{
+	struct journal_hdr hdr;
+	uint8_t *body;
+	size_t len;
+
+	if (!journal->adding)
+		return;
+
+	body = journal->buf + journal->open + sizeof(hdr);
+	len = journal->len - journal->open - sizeof(hdr);
+
+	hdr.len = L_CPU_TO_LE32(len);
+	hdr.crc = L_CPU_TO_LE32(crc32(body, len));
+	memcpy(journal->buf + journal->open, &hdr, sizeof(hdr));
+
+	journal->adding = false;
+}
+
+/* Appends the pending records at once. Still pending on failure */
+int journal_commit(struct journal *journal)
+{
+	ssize_t ret;
+	int err;
+
+	journal_seal(journal);
+
+	if (!journal->len)
+		return 0;
+
+	ret = write(journal->fd, journal->buf, journal->len);
+	if (ret == (ssize_t) journal->len) {
+		journal->size += ret;
+		journal->len = 0;
+		return 0;
+	}
+
+	err = ret < 0 ? -errno : -ENOSPC;
+
+	/* Drop the partial record: later records must follow a valid one */
+	if (ret > 0 && ftruncate(journal->fd, journal->size) < 0)
+		hal_log_error("journal %s: truncate failed", journal->path);
+
+	return err;
+}
+
+/* Drops the pending records: never appended */
+void journal_discard(struct journal *journal)
+{
+	journal->len = 0;
+	journal->adding = false;
+}
+
+int journal_sync(struct journal *journal)
+{
+	if (fdatasync(journal->fd) < 0)
+		return -errno;
+
+	return 0;
+}
+
+bool journal_needs_compaction(const struct journal *journal)
+{
+	return !journal->job && journal->size > JOURNAL_COMPACT_SIZE;
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, data, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0)
+			return -errno;
+
+		data += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Makes a rename() in the directory of pathname durable */
+static int sync_dir(const char *pathname)
+{
+	char *dir, *slash;
+	int fd, err = 0;
+
+	dir = l_strdup(pathname);
+	slash = strrchr(dir, '/');
+	if (slash)
+		*(slash == dir ? slash + 1 : slash) = '\0';
+
+	fd = open(slash ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	l_free(dir);
+	if (fd < 0)
+		return -errno;
+
+	if (fsync(fd) < 0)
+		err = -errno;
+
+	close(fd);
+
+	return err;
+}
+
+/*
+ * Write-to-temp-and-rename: either the old or the new snapshot is found
+ * after a crash, never a truncated one. The rotated journal goes only
+ * once the new snapshot is durable.
+ */
+static int snapshot_write(struct compact_job *job)
+{
+	char *tmp;
+	int fd, err;
+
+	tmp = l_strdup_printf("%s" SNAPSHOT_TMP_SUFFIX, job->snapshot);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		  S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		err = -errno;
+		goto done;
+	}
+
+	err = write_all(fd, job->data, job->len);
+	if (!err && fsync(fd) < 0)
+		err = -errno;
+
+	close(fd);
+
+	if (!err && rename(tmp, job->snapshot) < 0)
+		err = -errno;
+
+	if (!err)
+		err = sync_dir(job->snapshot);
+
+	if (!err && unlink(job->rotated) < 0 && errno != ENOENT)
+		err = -errno;
+
+	if (err)
+		unlink(tmp);
+
+done:
+	l_free(tmp);
+
+	return err;
+}
+
+static void *compact_thread(void *user_data)
+{
+	struct compact_job *job = user_data;
+	uint64_t value = 1;
+
+	job->err = snapshot_write(job);
+
+	if (write(job->efd, &value, sizeof(value)) < 0)
+		hal_log_error("journal: eventfd write failed");
+
+	job_unref(job);
+
+	return NULL;
+}
+
+static bool job_read(struct l_io *io, void *user_data)
+{
+	struct journal *journal = user_data;
+	struct compact_job *job = journal->job;
+	uint64_t value;
+
+	if (read(job->efd, &value, sizeof(value)) < 0)
+		return true;
+
+	journal->job = NULL;
+
+	if (job->err)
+		hal_log_error("journal %s: compaction failed: %s(%d)",
+			      journal->snapshot, strerror(-job->err),
+			      -job->err);
+	else
+		hal_log_info("journal %s: compacted", journal->snapshot);
+
+	/* Never destroy the l_io from its own callback */
+	l_idle_oneshot(job_release, job, NULL);
+
+	return false;
+}
+
+/*
+ * Moves the live journal aside and has data, the current content of
+ * the store, written as the new snapshot in the background. Takes over
+ * data. A rotated journal left by a failed or interrupted compaction is
+ * kept: the live one is not rotated over it, and both go away with the
+ * next successful compaction.
+ */
+int journal_compact(struct journal *journal, char *data, size_t len)
+{
+	struct compact_job *job;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int err;
+
+	if (journal->job) {
+		l_free(data);
+		return -EBUSY;
+	}
+
+	if (access(journal->rotated, F_OK) < 0) {
+		if (rename(journal->path, journal->rotated) < 0) {
+			l_free(data);
+			return -errno;
+		}
+
+		close(journal->fd);
+		err = open_live(journal);
+		if (err < 0) {
+			/* Keep appending to the old one */
+			rename(journal->rotated, journal->path);
+			open_live(journal);
+			l_free(data);
+			return err;
+		}
+	}
+
+	job = l_new(struct compact_job, 1);
+	job->refs = 2;			/* Main loop and thread */
+	job->snapshot = l_strdup(journal->snapshot);
+	job->rotated = l_strdup(journal->rotated);
+	job->data = data;
+	job->len = len;
+	job->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (job->efd < 0) {
+		err = errno;
+		goto fail;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&thread, &attr, compact_thread, job);
+	pthread_attr_destroy(&attr);
+	if (err)
+		goto fail;
+
+	job->io = l_io_new(job->efd);
+	l_io_set_read_handler(job->io, job_read, journal, NULL);
+	journal->job = job;
+
+	return 0;
+
+fail:
+	hal_log_error("journal %s: compaction: %s(%d)", journal->snapshot,
+		      strerror(err), err);
+	job->refs = 1;
+	job_unref(job);
+
+	return -err;
+}
@@ -0,0 +1,63 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Append-only journal of store changes. Each record holds the operations
+ * of one change or transaction, and pending records are written with a
+ * single write(): a record torn by a power loss fails its CRC and is
+ * dropped, together with anything after it, the next time the journal
+ * is replayed. Operations are idempotent, so replaying records already
+ * folded into the snapshot is harmless.
+ */
+
+#define JOURNAL_COMPACT_SIZE		(64 * 1024)	/* Bytes */
+#define JOURNAL_RECORD_MAX		(64 * 1024)	/* Operation bytes */
+
+enum journal_op {
+	JOURNAL_SET = 'S',		/* group, key, value */
+	JOURNAL_REMOVE = 'R',		/* group */
+};
+
+struct journal;
+
+typedef void (*journal_replay_func_t) (enum journal_op op, const char *group,
+				       const char *key, const char *value,
+				       void *user_data);
+
+int journal_replay(const char *pathname, journal_replay_func_t func,
+		   void *user_data);
+uint64_t journal_stamp(const char *pathname);
+
+struct journal *journal_open(const char *pathname);
+void journal_close(struct journal *journal);
+
+size_t journal_op_size(enum journal_op op, const char *group,
+		       const char *key, const char *value);
+void journal_add(struct journal *journal, enum journal_op op,
+		 const char *group, const char *key, const char *value);
+void journal_seal(struct journal *journal);
+int journal_commit(struct journal *journal);
+void journal_discard(struct journal *journal);
+int journal_sync(struct journal *journal);
+
+bool journal_needs_compaction(const struct journal *journal);
+int journal_compact(struct journal *journal, char *data, size_t len);
@@ -118,13 +118,14 @@ int main(int argc, char *argv[])
 	if (quit_to)
 		l_timeout_remove(quit_to);
 
-	l_main_exit();
-
 fail_detach:
 fail_setuid:
+	/* Main loop still alive: pending writes flushed, watches removed */
 	manager_stop();
 
 fail_manager_start:
+	l_main_exit();
+
 	hal_log_error("exiting ...");
 	hal_log_close();
 
@@ -26,6 +26,7 @@
 #include <stdint.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/socket.h>
 #include <ell/ell.h>
 
 #include "hal/nrf24.h"
@@ -34,6 +35,9 @@
 
 #include "storage.h"
 #include "adapter.h"
+#include "radio.h"
+#include "resolve.h"
+#include "shm.h"
 #include "dbus.h"
 #include "manager.h"
 #include "settings.h"
@@ -42,6 +46,13 @@ static struct l_dbus_client *client;
 
 static void service_available(struct l_dbus_client *client, void *user_data)
 {
+	/* Store-and-forward: pipes and devices survived the outage */
+	if (adapter_is_suspended()) {
+		hal_log_info("Service (knotd) available. Replaying stored data ...");
+		adapter_resume();
+		return;
+	}
+
 	hal_log_info("Service (knotd) available. Enabling local adapter ...");
 
 	adapter_enable();
@@ -49,6 +60,12 @@ static void service_available(struct l_dbus_client *client, void *user_data)
 
 static void service_unavailable(struct l_dbus *dbus, void *user_data)
 {
+	if (settings.store_frames) {
+		hal_log_info("Service(knotd) unavailable. Storing uplink data ...");
+		adapter_suspend();
+		return;
+	}
+
 	hal_log_info("Service(knotd) unavailable. Disabling local adapter ...");
 	adapter_disable();
 }
@@ -58,6 +75,18 @@ int manager_start(void)
 	struct nrf24_mac mac = { .address.uint64 = 0 };
 	char *mac_str;
 	int cfg_channel = 76, cfg_dbm = 0;
+	int cfg_batch = RADIO_BATCH_DEFAULT;
+	int cfg_retention = 7;
+	int cfg_lazy = 0;
+	int cfg_release = 0;
+	int cfg_paging = 500;
+	int cfg_pool = ADAPTER_POOL_DEFAULT;
+	int cfg_ttl = RESOLVE_TTL_DEFAULT;
+	int cfg_store = 0;
+	int cfg_window = 0;
+	int cfg_bytes = ADAPTER_COALESCE_BYTES;
+	int cfg_slots = 0;
+	int cfg_delay = 0;
 
 	settings.config_fd = storage_open(settings.config_filename);
 	if (settings.config_fd < 0) {
@@ -72,6 +101,36 @@ int manager_start(void)
 		return -EIO;
 	}
 
+	/*
+	 * Known nodes change by appending to a journal: a power loss in
+	 * the middle of a write must not lose every paired device.
+	 */
+	if (storage_enable_journal(settings.nodes_fd) < 0)
+		hal_log_error("%s: journal disabled", settings.nodes_filename);
+
+	/*
+	 * Milliseconds the known nodes file may lag behind changes, so
+	 * that a burst of pairings is written once. 0 writes every change
+	 * right away: otherwise AddDevice and Pair succeed before the write,
+	 * which can still fail. Config file only.
+	 */
+	storage_read_key_int(settings.config_fd, "Storage", "WriteBehind",
+			     &cfg_delay);
+
+	if (cfg_delay < 0 || cfg_delay > STORAGE_WRITE_BEHIND_MAX)
+		cfg_delay = 0;
+
+	storage_set_write_behind(settings.nodes_fd, cfg_delay);
+
+	/*
+	 * Binary copy of the known nodes file, mapped at startup instead
+	 * of parsing the file. Rebuilt whenever it is out of date. Config
+	 * file only.
+	 */
+	settings.nodedb_filename = storage_read_key_string(settings.config_fd,
+							   "Storage",
+							   "NodeDatabase");
+
 	/*
 	 * Priority order: 1) command line 2) config file.
 	 * If the user does not provide channel at command line (or channel is
@@ -85,6 +144,146 @@ int manager_start(void)
 	if (settings.channel < 0 || settings.channel > 125)
 		settings.channel = cfg_channel;
 
+	/*
+	 * Radio frames drained per socket on each scheduler pass. Command
+	 * line has priority over the config file.
+	 */
+	if (settings.batch < 0)
+		storage_read_key_int(settings.config_fd, "Radio", "BatchSize",
+				     &cfg_batch);
+
+	/* Sizes the frame arrays on the stack: never over RADIO_BATCH_MAX */
+	if (cfg_batch < 1 || cfg_batch > RADIO_BATCH_MAX)
+		cfg_batch = RADIO_BATCH_DEFAULT;
+
+	if (settings.batch < 1 || settings.batch > RADIO_BATCH_MAX)
+		settings.batch = cfg_batch;
+
+	/*
+	 * Seconds an unpaired device is kept after its last presence
+	 * beacon. Config file only.
+	 */
+	storage_read_key_int(settings.config_fd, "Radio", "UnpairedRetention",
+			     &cfg_retention);
+
+	if (cfg_retention < 1)
+		cfg_retention = 7;
+
+	settings.retention = cfg_retention * 1000;
+
+	/*
+	 * Stored devices are kept as in-memory records and get a D-Bus
+	 * object on their first presence beacon or FindDevice(), instead
+	 * of all at startup. With LazyDevices set, DeviceRelease seconds
+	 * offline and idle unregister the object again, 0 keeps it.
+	 * Config file only.
+	 */
+	storage_read_key_int(settings.config_fd, "Devices", "LazyDevices",
+			     &cfg_lazy);
+	settings.lazy_devices = cfg_lazy > 0;
+
+	storage_read_key_int(settings.config_fd, "Devices", "DeviceRelease",
+			     &cfg_release);
+
+	if (cfg_release < 0 || cfg_release > ADAPTER_RELEASE_MAX)
+		cfg_release = 0;
+
+	settings.device_release = settings.lazy_devices ?
+						cfg_release * 1000 : 0;
+
+	/*
+	 * Milliseconds to wait for the first frame of a connecting device
+	 * before the attempt is considered failed. Config file only.
+	 */
+	storage_read_key_int(settings.config_fd, "Radio", "PagingTimeout",
+			     &cfg_paging);
+
+	if (cfg_paging < 1)
+		cfg_paging = 500;
+
+	settings.paging_timeout = cfg_paging;
+
+	/*
+	 * knotd sockets connected ahead of time, so that attaching a
+	 * device does not wait for the upstream connect. 0 disables the
+	 * pool. Config file only.
+	 */
+	storage_read_key_int(settings.config_fd, "Knotd", "PoolSize",
+			     &cfg_pool);
+
+	if (cfg_pool < 0 || cfg_pool > ADAPTER_POOL_MAX)
+		cfg_pool = ADAPTER_POOL_DEFAULT;
+
+	settings.pool = cfg_pool;
+
+	/*
+	 * Seconds the resolved addresses of the knotd host (-h) are
+	 * cached before being resolved again. Config file only.
+	 */
+	storage_read_key_int(settings.config_fd, "Knotd", "ResolveTTL",
+			     &cfg_ttl);
+
+	if (cfg_ttl < 1)
+		cfg_ttl = RESOLVE_TTL_DEFAULT;
+
+	settings.resolve_ttl = cfg_ttl;
+
+	/*
+	 * Uplink frames kept in memory per device while knotd is
+	 * unavailable: radio links stay up and frames are replayed once
+	 * knotd is back. 0 disables it: knotd outages disable the adapter.
+	 * Overflow is spilled to files at StoreDir, if set, or dropped
+	 * oldest first. Config file only.
+	 */
+	storage_read_key_int(settings.config_fd, "Storage", "StoreFrames",
+			     &cfg_store);
+
+	if (cfg_store < 0 || cfg_store > ADAPTER_STORE_MAX)
+		cfg_store = 0;
+
+	settings.store_frames = cfg_store;
+	if (settings.store_frames)
+		settings.store_dir = storage_read_key_string(settings.config_fd,
+							     "Storage",
+							     "StoreDir");
+
+	/*
+	 * Remote knotd (-h) only: uplink frames of a device are written
+	 * together once CoalesceWindow microseconds have elapsed since the
+	 * first one, or earlier if CoalesceBytes are pending. Fewer TCP
+	 * segments at the cost of a bounded latency. 0 disables it. Config
+	 * file only.
+	 */
+	storage_read_key_int(settings.config_fd, "Knotd", "CoalesceWindow",
+			     &cfg_window);
+
+	if (cfg_window < 0 || cfg_window > ADAPTER_COALESCE_MAX)
+		cfg_window = 0;
+
+	settings.coalesce_window = cfg_window;
+
+	storage_read_key_int(settings.config_fd, "Knotd", "CoalesceBytes",
+			     &cfg_bytes);
+
+	if (cfg_bytes < 1 || cfg_bytes > 65536)
+		cfg_bytes = ADAPTER_COALESCE_BYTES;
+
+	settings.coalesce_bytes = cfg_bytes;
+
+	/*
+	 * Multiplexed mode (-M) with a local knotd only: slots of each
+	 * shared memory ring replacing the socket for frames, a power of
+	 * two. 0 disables it. Config file only.
+	 */
+	storage_read_key_int(settings.config_fd, "Knotd", "SharedMemorySlots",
+			     &cfg_slots);
+
+	if (cfg_slots < SHM_SLOTS_MIN || cfg_slots > SHM_SLOTS_MAX ||
+					(cfg_slots & (cfg_slots - 1)))
+		cfg_slots = 0;
+
+	settings.shm_slots = cfg_slots;
+
 	/*
 	 * Use TX Power from configuration file if it has not been passed
 	 * through cmd line. -255 means invalid: not informed by user.
@@ -142,4 +341,7 @@ void manager_stop(void)
 	l_dbus_client_destroy(client);
 	adapter_stop();
 	dbus_stop();
+
+	l_free(settings.store_dir);
+	l_free(settings.nodedb_filename);
 }
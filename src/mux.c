@@ -0,0 +1,691 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <ell/ell.h>
+
+#include "hal/linux_log.h"
+
+#include "radio.h"
+#include "shm.h"
+#include "mux.h"
+
+#define MUX_FRAME_MAX		(sizeof(struct mux_hdr) + MUX_PAYLOAD_MAX)
+#define MUX_SHM_TIMEOUT		1000	/* ms: knotd maps the rings */
+#define MUX_OUT_MAX		(64 * 1024)	/* Bytes queued for knotd */
+
+/* Frame the socket didn't take: written by mux_writable() */
+struct mux_out {
+	size_t len;
+	uint8_t data[];
+};
+
+struct mux {
+	struct l_io *io;
+	int sock;
+	bool stream;			/* TCP: frames must be reassembled */
+	bool ready;			/* Connected, Hello sent */
+	struct l_idle *lost;		/* Connection lost: mux_lost() queued */
+	mux_ready_func_t ready_func;
+	mux_data_func_t data_func;
+	mux_close_func_t close_func;
+	mux_disconnect_func_t disconnect_func;
+	void *user_data;
+	unsigned int shm_slots;		/* Rings requested: 0 if disabled */
+	struct shm *shm;		/* Rings replace the socket for frames */
+	struct shm *shm_pending;	/* Handed over, knotd not answered yet */
+	struct l_timeout *shm_timeout;	/* Gives up on shm_pending */
+	struct l_io *shm_io;		/* Doorbell: knotd -> nrfd ring */
+	struct l_queue *out;		/* Frames not written yet, in order */
+	size_t out_sent;		/* Bytes of the head frame written */
+	size_t out_len;			/* Bytes queued */
+	size_t len;			/* Bytes in buffer */
+	uint8_t buffer[2 * MUX_FRAME_MAX];
+};
+
+static struct mux *mux;
+
+static void mux_lost(struct l_idle *idle, void *user_data)
+{
+	mux_disconnect_func_t func;
+	void *data;
+
+	l_idle_remove(idle);
+	mux->lost = NULL;
+
+	func = mux->disconnect_func;
+	data = mux->user_data;
+
+	mux_stop();
+
+	if (func)
+		func(data);
+}
+
+static void mux_disconnect(struct l_io *io, void *user_data)
+{
+	if (mux->lost)
+		return;
+
+	hal_log_error("knotd multiplexed connection lost");
+
+	/* Never destroy the l_io from its own callback */
+	mux->lost = l_idle_create(mux_lost, NULL, NULL);
+}
+
+static void mux_shm_attached(void);
+
+/* Returns the frame length, 0 if incomplete or negative if malformed */
+static ssize_t mux_parse(const uint8_t *buffer, size_t len)
+{
+	const struct mux_hdr *hdr = (const struct mux_hdr *) buffer;
+	uint16_t plen;
+	uint64_t id;
+
+	if (len < sizeof(*hdr))
+		return 0;
+
+	plen = L_LE16_TO_CPU(hdr->len);
+	if (plen > MUX_PAYLOAD_MAX)
+		return -EMSGSIZE;
+
+	if (len < sizeof(*hdr) + plen)
+		return 0;
+
+	id = L_LE64_TO_CPU(hdr->id);
+
+	switch ((enum mux_type) hdr->type) {
+	case MUX_DATA:
+		mux->data_func(id, buffer + sizeof(*hdr), plen,
+			       mux->user_data);
+		break;
+	case MUX_CLOSE:
+		mux->close_func(id, mux->user_data);
+		break;
+	case MUX_SHM:
+		/* Unsolicited, or past MUX_SHM_TIMEOUT: rings already freed */
+		if (!mux->shm_pending)
+			return -EBADMSG;
+
+		mux_shm_attached();
+		break;
+	case MUX_HELLO:
+	case MUX_OPEN:
+	default:
+		return -EBADMSG;
+	}
+
+	return sizeof(*hdr) + plen;
+}
+
+static bool mux_read(struct l_io *io, void *user_data)
+{
+	ssize_t rx, flen;
+	size_t offset = 0;
+	int err;
+
+	rx = recv(mux->sock, mux->buffer + mux->len,
+		  sizeof(mux->buffer) - mux->len, MSG_DONTWAIT);
+	if (rx < 0) {
+		err = errno;
+		if (err != EAGAIN && err != EINTR)
+			hal_log_error("mux recv(): %s(%d)", strerror(err), err);
+		return true;
+	}
+
+	if (rx == 0)
+		return true;	/* Orderly shutdown: disconnect handler */
+
+	mux->len += rx;
+
+	/* SOCK_SEQPACKET: exactly one frame per record */
+	do {
+		flen = mux_parse(mux->buffer + offset, mux->len - offset);
+
+		/* A callback may have stopped the mux */
+		if (!mux)
+			return false;
+
+		if (flen < 0 || (flen == 0 && !mux->stream)) {
+			hal_log_error("mux: malformed frame from knotd");
+			mux_disconnect(io, NULL);
+			return false;
+		}
+
+		offset += flen;
+	} while (flen > 0 && offset < mux->len);
+
+	/* Keep the partial frame for the next read */
+	mux->len -= offset;
+	memmove(mux->buffer, mux->buffer + offset, mux->len);
+
+	return true;
+}
+
+static bool mux_shm_read(struct l_io *io, void *user_data)
+{
+	const uint8_t *slot;
+	uint64_t value;
+	ssize_t flen;
+
+	/* Non-blocking eventfd: the counter is reset, the value unused */
+	if (read(l_io_get_fd(io), &value, sizeof(value)) < 0 &&
+							errno != EAGAIN)
+		return true;
+
+	while ((slot = shm_peek(mux->shm)) != NULL) {
+		flen = mux_parse(slot, SHM_SLOT_SIZE);
+
+		/* A callback may have stopped the mux: slot is unmapped */
+		if (!mux)
+			return false;
+
+		if (flen <= 0) {
+			hal_log_error("mux: malformed frame from knotd ring");
+			mux_disconnect(io, NULL);
+			return false;
+		}
+
+		shm_release(mux->shm);
+	}
+
+	return true;
+}
+
+/* One frame per slot: copied in place, no syscall unless knotd sleeps */
+static int mux_shm_write(enum mux_type type, uint64_t id,
+			 const void *payload, size_t len)
+{
+	struct mux_hdr *hdr;
+
+	if (len > MUX_PAYLOAD_MAX)
+		return -EMSGSIZE;
+
+	hdr = shm_reserve(mux->shm);
+	if (!hdr)
+		return -ENOBUFS;
+
+	hdr->type = type;
+	hdr->flags = 0;
+	hdr->len = L_CPU_TO_LE16(len);
+	hdr->id = L_CPU_TO_LE64(id);
+	memcpy(hdr + 1, payload, len);
+
+	return shm_commit(mux->shm);
+}
+
+/* Writes queued frames in order, as far as the socket takes them */
+static int mux_flush(void)
+{
+	struct mux_out *out;
+	ssize_t ret;
+
+	while ((out = l_queue_peek_head(mux->out)) != NULL) {
+		ret = send(mux->sock, out->data + mux->out_sent,
+			   out->len - mux->out_sent,
+			   MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0)
+			return errno == EAGAIN ? -EAGAIN : -errno;
+
+		/* TCP: the rest of the frame goes first next time */
+		mux->out_sent += ret;
+		if (mux->out_sent < out->len)
+			return -EAGAIN;
+
+		mux->out_sent = 0;
+		mux->out_len -= out->len;
+		l_free(l_queue_pop_head(mux->out));
+	}
+
+	return 0;
+}
+
+static bool mux_writable(struct l_io *io, void *user_data)
+{
+	int err;
+
+	err = mux_flush();
+	if (err == -EAGAIN)
+		return true;
+
+	if (err < 0) {
+		hal_log_error("mux send(): %s(%d)", strerror(-err), -err);
+		mux_disconnect(io, NULL);
+	}
+
+	return false;
+}
+
+/*
+ * Queues the frame, sent bytes of it written already, behind the frames
+ * the socket didn't take. A frame started is always queued: the rest of
+ * the stream depends on it.
+ */
+static int mux_queue(enum mux_type type, uint64_t id, const void *payload,
+		     size_t len, size_t sent)
+{
+	struct mux_hdr *hdr;
+	struct mux_out *out;
+	size_t flen = sizeof(*hdr) + len;
+
+	if (!sent && mux->out_len + flen > MUX_OUT_MAX)
+		return -ENOBUFS;
+
+	out = l_malloc(sizeof(*out) + flen);
+	out->len = flen;
+
+	hdr = (struct mux_hdr *) out->data;
+	hdr->type = type;
+	hdr->flags = 0;
+	hdr->len = L_CPU_TO_LE16(len);
+	hdr->id = L_CPU_TO_LE64(id);
+	memcpy(hdr + 1, payload, len);
+
+	if (l_queue_isempty(mux->out)) {
+		mux->out_sent = sent;
+		l_io_set_write_handler(mux->io, mux_writable, NULL, NULL);
+	}
+
+	l_queue_push_tail(mux->out, out);
+	mux->out_len += flen;
+
+	return 0;
+}
+
+/* Never blocks: what the socket doesn't take is queued */
+static int mux_write(enum mux_type type, uint64_t id, const void *payload,
+		     size_t len)
+{
+	struct mux_hdr hdr;
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t ret;
+
+	if (!mux)
+		return -ENOTCONN;
+
+	if (mux->shm)
+		return mux_shm_write(type, id, payload, len);
+
+	if (!l_queue_isempty(mux->out))
+		return mux_queue(type, id, payload, len, 0);
+
+	hdr.type = type;
+	hdr.flags = 0;
+	hdr.len = L_CPU_TO_LE16(len);
+	hdr.id = L_CPU_TO_LE64(id);
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *) payload;
+	iov[1].iov_len = len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = len ? 2 : 1;
+
+	ret = sendmsg(mux->sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (ret < 0 && errno != EAGAIN && errno != EINTR)
+		return -errno;
+
+	if (ret < 0)
+		ret = 0;
+
+	if ((size_t) ret == sizeof(hdr) + len)
+		return 0;
+
+	return mux_queue(type, id, payload, len, ret);
+}
+
+/* Connected, Hello sent and rings mapped (if any): frames may be sent */
+static void mux_set_ready(void)
+{
+	mux->ready = true;
+	mux->ready_func(mux->user_data);
+}
+
+/* knotd mapped the rings: every frame goes through them from now on */
+static void mux_shm_attached(void)
+{
+	int fds[3];
+
+	l_timeout_remove(mux->shm_timeout);
+	mux->shm_timeout = NULL;
+
+	mux->shm = mux->shm_pending;
+	mux->shm_pending = NULL;
+
+	shm_get_fds(mux->shm, &fds[0], &fds[1], &fds[2]);
+	mux->shm_io = l_io_new(fds[2]);
+	l_io_set_read_handler(mux->shm_io, mux_shm_read, NULL, NULL);
+
+	mux_set_ready();
+}
+
+/* No answer from knotd: frames stay on the socket */
+static void mux_shm_timeout(struct l_timeout *timeout, void *user_data)
+{
+	hal_log_error("mux shm: %s(%d)", strerror(ETIMEDOUT), ETIMEDOUT);
+
+	l_timeout_remove(mux->shm_timeout);
+	mux->shm_timeout = NULL;
+
+	shm_free(mux->shm_pending);
+	mux->shm_pending = NULL;
+
+	mux_set_ready();
+}
+
+/*
+ * Hands the rings over to knotd (SCM_RIGHTS: memfd, nrfd -> knotd and
+ * knotd -> nrfd doorbells). Nothing else may be sent until knotd maps
+ * them (see mux_shm_attached()): frames on the socket and on the rings
+ * are not ordered with each other. UNIX socket only.
+ */
+static int mux_shm_request(unsigned int slots)
+{
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	struct mux_hdr hdr;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov[2];
+	struct shm *shm;
+	uint32_t payload;
+	int fds[3];
+	int err;
+
+	shm = shm_new(slots);
+	if (!shm)
+		return -ENOMEM;
+
+	shm_get_fds(shm, &fds[0], &fds[1], &fds[2]);
+
+	hdr.type = MUX_SHM;
+	hdr.flags = 0;
+	hdr.len = L_CPU_TO_LE16(sizeof(payload));
+	hdr.id = 0;
+	payload = L_CPU_TO_LE32(slots);
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = &payload;
+	iov[1].iov_len = sizeof(payload);
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(mux->sock, &msg, MSG_NOSIGNAL) < 0) {
+		err = -errno;
+		shm_free(shm);
+		return err;
+	}
+
+	/* Answered from mux_read(): the main loop never waits for knotd */
+	mux->shm_pending = shm;
+	mux->shm_timeout = l_timeout_create_ms(MUX_SHM_TIMEOUT,
+					       mux_shm_timeout, NULL, NULL);
+
+	return 0;
+}
+
+/* Socket writable: connected (non-blocking TCP connect completed) */
+static bool mux_connected(struct l_io *io, void *user_data)
+{
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (getsockopt(mux->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+
+	/* The socket stays non-blocking: see mux_write() */
+	if (!err)
+		err = -mux_write(MUX_HELLO, MUX_VERSION, NULL, 0);
+
+	if (err) {
+		hal_log_error("mux connect: %s(%d)", strerror(err), err);
+		mux_disconnect(io, NULL);
+		return false;
+	}
+
+	/*
+	 * Co-located knotd: ready once the rings are mapped. Not if Hello
+	 * is still queued: the request would overtake it.
+	 */
+	if (mux->shm_slots && !mux->stream && l_queue_isempty(mux->out)) {
+		err = mux_shm_request(mux->shm_slots);
+		if (!err)
+			return false;
+
+		hal_log_error("mux shm: %s(%d)", strerror(-err), -err);
+	}
+
+	mux_set_ready();
+
+	/* Hello queued: mux_writable() replaced this handler */
+	return !l_queue_isempty(mux->out);
+}
+
+/*
+ * Takes ownership of sock: closed on failure or by mux_stop(). sock may
+ * still be connecting: ready_func is called once Hello is sent and the
+ * shared memory rings (shm_slots, 0 disables them) are mapped or given
+ * up on, from the main loop. Frames can't be sent before.
+ */
+int mux_start(int sock, bool stream, unsigned int shm_slots,
+	      mux_ready_func_t ready_func, mux_data_func_t data_func,
+	      mux_close_func_t close_func,
+	      mux_disconnect_func_t disconnect_func, void *user_data)
+{
+	if (mux) {
+		close(sock);
+		return -EALREADY;
+	}
+
+	mux = l_new(struct mux, 1);
+	mux->sock = sock;
+	mux->stream = stream;
+	mux->shm_slots = shm_slots;
+	mux->ready_func = ready_func;
+	mux->data_func = data_func;
+	mux->close_func = close_func;
+	mux->disconnect_func = disconnect_func;
+	mux->user_data = user_data;
+	mux->out = l_queue_new();
+
+	mux->io = l_io_new(sock);
+	l_io_set_close_on_destroy(mux->io, true);
+	l_io_set_read_handler(mux->io, mux_read, NULL, NULL);
+	l_io_set_disconnect_handler(mux->io, mux_disconnect, NULL, NULL);
+	l_io_set_write_handler(mux->io, mux_connected, NULL, NULL);
+
+	return 0;
+}
+
+void mux_stop(void)
+{
+	if (!mux)
+		return;
+
+	/* Closes sock */
+	l_idle_remove(mux->lost);
+	l_timeout_remove(mux->shm_timeout);
+	l_io_destroy(mux->io);
+	l_io_destroy(mux->shm_io);
+	shm_free(mux->shm_pending);
+	shm_free(mux->shm);
+	l_queue_destroy(mux->out, l_free);
+	l_free(mux);
+	mux = NULL;
+}
+
+bool mux_is_running(void)
+{
+	return mux != NULL;
+}
+
+bool mux_is_ready(void)
+{
+	return mux && mux->ready;
+}
+
+int mux_open(uint64_t id)
+{
+	if (!mux_is_ready())
+		return -ENOTCONN;
+
+	return mux_write(MUX_OPEN, id, NULL, 0);
+}
+
+int mux_close(uint64_t id)
+{
+	/* Never opened if still connecting */
+	if (!mux_is_ready())
+		return -ENOTCONN;
+
+	return mux_write(MUX_CLOSE, id, NULL, 0);
+}
+
+/* Queues frames first on, sent bytes of the first written already */
+static int mux_send_queue(uint64_t id, const struct iovec *iov,
+			  unsigned int count, unsigned int first, size_t sent)
+{
+	unsigned int i;
+	int err;
+
+	for (i = first; i < count; i++) {
+		err = mux_queue(MUX_DATA, id, iov[i].iov_base,
+				iov[i].iov_len, i == first ? sent : 0);
+		if (err < 0)
+			return i ? (int) i : err;
+	}
+
+	return count;
+}
+
+/* Frames of one device in a single syscall: one record each */
+int mux_send(uint64_t id, const struct iovec *iov, unsigned int count)
+{
+	struct mux_hdr hdr[RADIO_BATCH_MAX];
+	struct iovec msg_iov[RADIO_BATCH_MAX][2];
+	struct mmsghdr msgs[RADIO_BATCH_MAX];
+	unsigned int i;
+	size_t flen;
+	ssize_t ret;
+	int sent;
+
+	if (!mux_is_ready())
+		return -ENOTCONN;
+
+	if (count > RADIO_BATCH_MAX)
+		count = RADIO_BATCH_MAX;
+
+	/* Shared memory rings: one slot per frame */
+	if (mux->shm) {
+		for (i = 0; i < count; i++) {
+			sent = mux_shm_write(MUX_DATA, id, iov[i].iov_base,
+					     iov[i].iov_len);
+			if (sent < 0)
+				return i ? (int) i : sent;
+		}
+
+		return count;
+	}
+
+	/* Behind the frames queued already */
+	if (!l_queue_isempty(mux->out))
+		return mux_send_queue(id, iov, count, 0, 0);
+
+	memset(msgs, 0, count * sizeof(*msgs));
+	for (i = 0; i < count; i++) {
+		hdr[i].type = MUX_DATA;
+		hdr[i].flags = 0;
+		hdr[i].len = L_CPU_TO_LE16(iov[i].iov_len);
+		hdr[i].id = L_CPU_TO_LE64(id);
+
+		msg_iov[i][0].iov_base = &hdr[i];
+		msg_iov[i][0].iov_len = sizeof(hdr[i]);
+		msg_iov[i][1] = iov[i];
+
+		msgs[i].msg_hdr.msg_iov = msg_iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 2;
+	}
+
+	/* TCP: one write, a frame after a short one would break the stream */
+	if (mux->stream) {
+		msgs[0].msg_hdr.msg_iovlen = 2 * count;
+		ret = sendmsg(mux->sock, &msgs[0].msg_hdr,
+			      MSG_NOSIGNAL | MSG_DONTWAIT);
+	} else
+		ret = sendmmsg(mux->sock, msgs, count,
+			       MSG_NOSIGNAL | MSG_DONTWAIT);
+
+	if (ret < 0 && errno != EAGAIN && errno != EINTR)
+		return -errno;
+
+	if (ret < 0)
+		ret = 0;
+
+	/* SOCK_SEQPACKET: records are taken whole or not at all */
+	if (!mux->stream)
+		return (unsigned int) ret == count ? (int) count :
+				mux_send_queue(id, iov, count, ret, 0);
+
+	/* Frames written whole, then bytes of the next one */
+	for (i = 0; i < count; i++) {
+		flen = sizeof(struct mux_hdr) + iov[i].iov_len;
+		if ((size_t) ret < flen)
+			break;
+
+		ret -= flen;
+	}
+
+	if (i == count)
+		return count;
+
+	return mux_send_queue(id, iov, count, i, ret);
+}
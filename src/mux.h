@@ -0,0 +1,64 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Multiplexed upstream: every device shares one connection to knotd.
+ * Each frame starts with a mux_hdr (little endian). SOCK_SEQPACKET
+ * carries one frame per record, on TCP frames are back to back.
+ * See doc/knotd-mux.txt.
+ */
+
+#define MUX_VERSION			1
+#define MUX_PAYLOAD_MAX			512
+
+enum mux_type {
+	MUX_HELLO = 0,		/* nrfd -> knotd, first frame: id = version */
+	MUX_OPEN,		/* nrfd -> knotd: device connected */
+	MUX_CLOSE,		/* Either side: device disconnected */
+	MUX_DATA,		/* Either side: one device frame */
+	MUX_SHM,		/* Socket only: shared memory rings */
+};
+
+struct mux_hdr {
+	uint8_t type;
+	uint8_t flags;		/* Reserved: 0 */
+	uint16_t len;		/* Payload length */
+	uint64_t id;		/* Device address */
+} __attribute__ ((packed));
+
+typedef void (*mux_ready_func_t) (void *user_data);
+typedef void (*mux_data_func_t) (uint64_t id, const void *buffer,
+				 size_t len, void *user_data);
+typedef void (*mux_close_func_t) (uint64_t id, void *user_data);
+typedef void (*mux_disconnect_func_t) (void *user_data);
+
+int mux_start(int sock, bool stream, unsigned int shm_slots,
+	      mux_ready_func_t ready_func, mux_data_func_t data_func,
+	      mux_close_func_t close_func,
+	      mux_disconnect_func_t disconnect_func, void *user_data);
+void mux_stop(void);
+bool mux_is_running(void);
+bool mux_is_ready(void);
+
+int mux_open(uint64_t id);
+int mux_close(uint64_t id);
+int mux_send(uint64_t id, const struct iovec *iov, unsigned int count);
@@ -0,0 +1,425 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <ell/ell.h>
+
+#include "hal/nrf24.h"
+#include "hal/linux_log.h"
+
+#include "journal.h"
+#include "storage.h"
+#include "nodedb.h"
+
+#define NODEDB_MAGIC			"NRDB"
+#define NODEDB_VERSION			1
+#define NODEDB_TMP_SUFFIX		".tmp"
+
+/* Little endian */
+struct nodedb_hdr {
+	char magic[4];
+	uint32_t version;
+	uint32_t count;			/* Records */
+	uint32_t heap_len;		/* Bytes */
+	uint64_t stamp;			/* Store exported from, 0: provisioned */
+} __attribute__ ((packed));
+
+struct nodedb_rec {
+	uint64_t addr;
+	uint32_t id;			/* Heap offsets */
+	uint32_t name;
+} __attribute__ ((packed));
+
+struct nodedb {
+	void *map;
+	size_t size;
+	const struct nodedb_rec *recs;	/* Sorted by address */
+	const char *heap;
+	uint32_t count;
+	uint32_t heap_len;
+	uint64_t stamp;
+};
+
+/* The heap ends with a NUL: any offset inside it is a valid string */
+static const char *heap_string(const struct nodedb *db, uint32_t off)
+{
+	uint32_t cpu = L_LE32_TO_CPU(off);
+
+	return cpu < db->heap_len ? db->heap + cpu : NULL;
+}
+
+static struct nodedb *nodedb_open(const char *pathname)
+{
+	const struct nodedb_hdr *hdr;
+	struct nodedb *db;
+	struct stat st;
+	void *map;
+	uint64_t size;
+	int fd;
+
+	fd = open(pathname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	hdr = map;
+	size = sizeof(*hdr) +
+		(uint64_t) L_LE32_TO_CPU(hdr->count) * sizeof(struct nodedb_rec) +
+		L_LE32_TO_CPU(hdr->heap_len);
+
+	if (memcmp(hdr->magic, NODEDB_MAGIC, sizeof(hdr->magic)) ||
+			L_LE32_TO_CPU(hdr->version) != NODEDB_VERSION ||
+			size != (uint64_t) st.st_size)
+		goto invalid;
+
+	db = l_new(struct nodedb, 1);
+	db->map = map;
+	db->size = st.st_size;
+	db->count = L_LE32_TO_CPU(hdr->count);
+	db->heap_len = L_LE32_TO_CPU(hdr->heap_len);
+	db->stamp = L_LE64_TO_CPU(hdr->stamp);
+	db->recs = map + sizeof(*hdr);
+	db->heap = map + sizeof(*hdr) + db->count * sizeof(struct nodedb_rec);
+
+	if (db->heap_len && db->heap[db->heap_len - 1] == '\0')
+		return db;
+
+	l_free(db);
+
+invalid:
+	hal_log_error("%s: invalid node database", pathname);
+	munmap(map, st.st_size);
+
+	return NULL;
+}
+
+void nodedb_close(struct nodedb *db)
+{
+	if (unlikely(!db))
+		return;
+
+	munmap(db->map, db->size);
+	l_free(db);
+}
+
+/* Strings point into the map: valid until nodedb_close() */
+void nodedb_foreach(const struct nodedb *db, storage_foreach_func_t func,
+		    void *user_data)
+{
+	const struct nodedb_rec *rec;
+	struct nrf24_mac mac;
+	const char *id, *name;
+	char mac_str[24];
+	uint32_t i;
+
+	for (i = 0; i < db->count; i++) {
+		rec = &db->recs[i];
+		id = heap_string(db, rec->id);
+		name = heap_string(db, rec->name);
+		if (!id || !name)
+			continue;
+
+		mac.address.uint64 = L_LE64_TO_CPU(rec->addr);
+		if (nrf24_mac2str(&mac, mac_str) != 0)
+			continue;
+
+		func(mac_str, id, name, user_data);
+	}
+}
+
+struct export {
+	struct nodedb_rec *recs;
+	uint32_t count;
+	uint32_t alloc;
+	char *heap;
+	size_t heap_len;
+	size_t heap_alloc;
+};
+
+static uint32_t heap_append(struct export *exp, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	uint32_t off = exp->heap_len;
+
+	if (exp->heap_len + len > exp->heap_alloc) {
+		exp->heap_alloc = (exp->heap_len + len) * 2;
+		exp->heap = l_realloc(exp->heap, exp->heap_alloc);
+	}
+
+	memcpy(exp->heap + exp->heap_len, str, len);
+	exp->heap_len += len;
+
+	return L_CPU_TO_LE32(off);
+}
+
+static void export_node(const char *mac, const char *id, const char *name,
+			void *user_data)
+{
+	struct export *exp = user_data;
+	struct nodedb_rec *rec;
+	struct nrf24_mac addr;
+
+	if (nrf24_str2mac(mac, &addr) < 0)
+		return;
+
+	/* Heap offsets are 32 bits */
+	if (exp->heap_len + strlen(id) + strlen(name) + 2 > UINT32_MAX)
+		return;
+
+	if (exp->count == exp->alloc) {
+		exp->alloc = exp->alloc ? exp->alloc * 2 : 64;
+		exp->recs = l_realloc(exp->recs,
+				      exp->alloc * sizeof(*exp->recs));
+	}
+
+	rec = &exp->recs[exp->count++];
+	rec->addr = L_CPU_TO_LE64(addr.address.uint64);
+	rec->id = heap_append(exp, id);
+	rec->name = heap_append(exp, name);
+}
+
+static int rec_cmp(const void *a, const void *b)
+{
+	uint64_t addr_a = L_LE64_TO_CPU(((const struct nodedb_rec *) a)->addr);
+	uint64_t addr_b = L_LE64_TO_CPU(((const struct nodedb_rec *) b)->addr);
+
+	return addr_a < addr_b ? -1 : addr_a > addr_b;
+}
+
+static int write_file(const char *pathname, struct iovec *iov, int iovcnt)
+{
+	char *tmp;
+	ssize_t ret;
+	size_t len = 0;
+	int i, fd, err = 0;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	tmp = l_strdup_printf("%s" NODEDB_TMP_SUFFIX, pathname);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		  S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		err = -errno;
+		goto done;
+	}
+
+	/* Partial writes are left to the size check of nodedb_open() */
+	ret = writev(fd, iov, iovcnt);
+	if (ret < 0)
+		err = -errno;
+	else if ((size_t) ret != len)
+		err = -ENOSPC;
+
+	close(fd);
+
+	/* Readers map either the old or the new file */
+	if (!err && rename(tmp, pathname) < 0)
+		err = -errno;
+
+	if (err)
+		unlink(tmp);
+
+done:
+	l_free(tmp);
+
+	return err;
+}
+
+/* Writes the known nodes of the store as the database at pathname */
+int nodedb_export(const char *pathname, int store_fd)
+{
+	struct export exp;
+	struct nodedb_hdr hdr;
+	struct iovec iov[3];
+	int err;
+
+	memset(&exp, 0, sizeof(exp));
+	storage_foreach_nrf24_keys(store_fd, export_node, &exp);
+
+	qsort(exp.recs, exp.count, sizeof(*exp.recs), rec_cmp);
+
+	/* Never empty: the trailing NUL check needs a byte */
+	if (!exp.heap_len)
+		heap_append(&exp, "");
+
+	memcpy(hdr.magic, NODEDB_MAGIC, sizeof(hdr.magic));
+	hdr.version = L_CPU_TO_LE32(NODEDB_VERSION);
+	hdr.count = L_CPU_TO_LE32(exp.count);
+	hdr.heap_len = L_CPU_TO_LE32(exp.heap_len);
+	/* Taken once parsed: the replay may have trimmed the journal */
+	hdr.stamp = L_CPU_TO_LE64(storage_stamp(store_fd));
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = exp.recs;
+	iov[1].iov_len = exp.count * sizeof(*exp.recs);
+	iov[2].iov_base = exp.heap;
+	iov[2].iov_len = exp.heap_len;
+
+	err = write_file(pathname, iov, 3);
+
+	l_free(exp.recs);
+	l_free(exp.heap);
+
+	return err;
+}
+
+struct import {
+	int store_fd;
+	struct storage_txn *txn;
+	size_t size;			/* Journal bytes of txn, at most */
+	int err;
+};
+
+static void import_commit(struct import *imp)
+{
+	int err;
+
+	if (!imp->txn)
+		return;
+
+	err = storage_commit(imp->txn);
+	if (err < 0)
+		imp->err = err;
+
+	imp->txn = NULL;
+	imp->size = 0;
+}
+
+/* Values may be escaped by the store: twice as long at most */
+static size_t import_op_size(const char *group, const char *key,
+			     const char *value)
+{
+	return journal_op_size(JOURNAL_SET, group, key, value) +
+							strlen(value);
+}
+
+static void import_node(const char *mac, const char *id, const char *name,
+			void *user_data)
+{
+	struct import *imp = user_data;
+	size_t size;
+
+	/* Nothing more once a batch failed: imported again next time */
+	if (imp->err < 0)
+		return;
+
+	/* A batch is one journal record: committed before it overflows */
+	size = import_op_size(mac, "Name", name) +
+					import_op_size(mac, "Id", id);
+	if (imp->size + size > JOURNAL_RECORD_MAX)
+		import_commit(imp);
+
+	if (!imp->txn)
+		imp->txn = storage_begin(imp->store_fd);
+
+	if (!imp->txn) {
+		imp->err = -EIO;
+		return;
+	}
+
+	storage_txn_set_string(imp->txn, mac, "Name", name);
+	storage_txn_set_string(imp->txn, mac, "Id", id);
+	imp->size += size;
+}
+
+/* Adds the nodes of the database to the store, in batches */
+int nodedb_import(const struct nodedb *db, int store_fd)
+{
+	struct import imp;
+
+	memset(&imp, 0, sizeof(imp));
+	imp.store_fd = store_fd;
+
+	nodedb_foreach(db, import_node, &imp);
+	import_commit(&imp);
+
+	if (imp.err < 0)
+		return imp.err;
+
+	return storage_sync(store_fd);
+}
+
+/*
+ * Maps the database at pathname, exported again first if it doesn't
+ * match the current content of the store. A database with a 0 stamp
+ * has been provisioned offline: its nodes are imported into the store
+ * before that. If the import fails the file is left as is, to be
+ * imported again on the next start, and NULL is returned.
+ */
+struct nodedb *nodedb_load(const char *pathname, int store_fd)
+{
+	struct nodedb *db;
+	int err;
+
+	db = nodedb_open(pathname);
+	if (db && db->stamp == storage_stamp(store_fd))
+		return db;
+
+	if (db && !db->stamp) {
+		hal_log_info("%s: importing %u node(s)", pathname, db->count);
+		err = nodedb_import(db, store_fd);
+		if (err < 0) {
+			hal_log_error("%s: import: %s(%d)", pathname,
+				      strerror(-err), -err);
+			nodedb_close(db);
+			return NULL;
+		}
+	}
+
+	nodedb_close(db);
+
+	err = nodedb_export(pathname, store_fd);
+	if (err < 0) {
+		hal_log_error("%s: export: %s(%d)", pathname,
+			      strerror(-err), -err);
+		return NULL;
+	}
+
+	return nodedb_open(pathname);
+}
@@ -0,0 +1,41 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Binary copy of the known nodes store, mmap'd read-only: fixed-size
+ * records sorted by address, followed by a heap of NUL terminated
+ * strings. Startup registers every known node straight from the map,
+ * without parsing the store nor allocating per node. The store remains
+ * the reference: the database is exported from it again whenever the
+ * stamp it was built from is outdated.
+ */
+
+struct nodedb;
+
+struct nodedb *nodedb_load(const char *pathname, int store_fd);
+void nodedb_close(struct nodedb *db);
+
+int nodedb_export(const char *pathname, int store_fd);
+int nodedb_import(const struct nodedb *db, int store_fd);
+
+void nodedb_foreach(const struct nodedb *db, storage_foreach_func_t func,
+		    void *user_data);
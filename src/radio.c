@@ -0,0 +1,420 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <ell/ell.h>
+
+#include "hal/linux_log.h"
+#include "hal/comm.h"
+
+#include "ring.h"
+#include "radio.h"
+
+#define RADIO_RING_SLOTS		64
+#define RADIO_MAX_SOCKS			8
+#define RADIO_POLL_MIN			1	/* ms */
+#define RADIO_POLL_MAX			16	/* ms */
+
+struct radio_frame {
+	int sock;
+	unsigned int id;		/* See sock_id(): 0 for mgmtfd */
+	size_t len;
+	uint8_t buffer[256];
+};
+
+/* hal_comm_write() result of a frame handed over to the thread */
+struct radio_done {
+	int sock;
+	unsigned int id;
+	ssize_t ret;
+};
+
+struct radio_thread {
+	pthread_t thread;
+	bool running;
+	int mgmtfd;
+	unsigned int batch;		/* Frames per socket and pass */
+	int socks[RADIO_MAX_SOCKS];	/* Data sockets: owned by hal_lock */
+	unsigned int ids[RADIO_MAX_SOCKS]; /* Tell reused socket numbers apart */
+	unsigned int next_id;
+	int nsocks;
+	struct ring *rx_ring;		/* Radio thread -> main loop */
+	struct ring *tx_ring;		/* Main loop -> radio thread */
+	struct ring *done_ring;		/* Radio thread -> main loop: TX results */
+	int rx_efd;			/* Wakes up the main loop */
+	int tx_efd;			/* Wakes up the radio thread */
+	struct l_io *rx_io;
+	radio_frame_func_t func;
+	radio_write_func_t write_func;
+	void *user_data;
+};
+
+/* Serializes control calls (socket, connect, close) with the thread */
+static pthread_mutex_t hal_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct radio_thread *rt;
+
+static void efd_signal(int efd)
+{
+	uint64_t val = 1;
+
+	if (write(efd, &val, sizeof(val)) < 0)
+		hal_log_error("eventfd write(): %s(%d)",
+			      strerror(errno), errno);
+}
+
+/* 0 if unknown. The table is only changed by the main loop, under hal_lock */
+static unsigned int sock_id(int sock)
+{
+	int i;
+
+	for (i = 0; i < rt->nsocks; i++) {
+		if (rt->socks[i] == sock)
+			return rt->ids[i];
+	}
+
+	return 0;
+}
+
+static bool thread_read(int sock, bool *pushed)
+{
+	struct radio_frame *frame;
+	ssize_t len;
+	unsigned int count;
+	bool active = false;
+
+	/* Ring full: leave frames on the radio until the main loop drains */
+	for (count = 0; count < rt->batch; count++) {
+		frame = ring_reserve(rt->rx_ring);
+		if (!frame)
+			break;
+
+		len = hal_comm_read(sock, frame->buffer,
+				    sizeof(frame->buffer));
+		if (len <= 0)
+			break;
+
+		frame->sock = sock;
+		frame->id = sock_id(sock);
+		frame->len = len;
+		ring_commit(rt->rx_ring);
+		active = true;
+	}
+
+	*pushed |= active;
+
+	return active;
+}
+
+/* Results go back to the main loop: retries and drops are decided there */
+static bool thread_write(bool *pushed)
+{
+	struct radio_frame *frame;
+	struct radio_done *done;
+	bool active = false;
+
+	while ((frame = ring_peek(rt->tx_ring)) != NULL) {
+		/* Socket closed since, its number possibly reused */
+		if (frame->id != sock_id(frame->sock)) {
+			ring_release(rt->tx_ring);
+			continue;
+		}
+
+		/* Results not drained yet: frames wait on the ring */
+		done = ring_reserve(rt->done_ring);
+		if (!done)
+			break;
+
+		done->sock = frame->sock;
+		done->id = frame->id;
+		done->ret = hal_comm_write(frame->sock, frame->buffer,
+					   frame->len);
+		ring_commit(rt->done_ring);
+		ring_release(rt->tx_ring);
+		active = true;
+	}
+
+	*pushed |= active;
+
+	return active;
+}
+
+static void *thread_run(void *user_data)
+{
+	struct pollfd pfd = { .fd = rt->tx_efd, .events = POLLIN };
+	int interval = RADIO_POLL_MIN;
+	uint64_t val;
+	bool active;
+	bool pushed;
+	int i;
+
+	while (__atomic_load_n(&rt->running, __ATOMIC_ACQUIRE)) {
+		pushed = false;
+
+		pthread_mutex_lock(&hal_lock);
+		active = thread_write(&pushed);
+		active |= thread_read(rt->mgmtfd, &pushed);
+		for (i = 0; i < rt->nsocks; i++)
+			active |= thread_read(rt->socks[i], &pushed);
+		pthread_mutex_unlock(&hal_lock);
+
+		if (pushed)
+			efd_signal(rt->rx_efd);
+
+		/* Same adaptive backoff as the main loop scheduler */
+		if (active)
+			interval = RADIO_POLL_MIN;
+		else if (interval < RADIO_POLL_MAX)
+			interval <<= 1;
+
+		/* Downlink frames cut the sleep short */
+		if (poll(&pfd, 1, interval) > 0 &&
+		    read(rt->tx_efd, &val, sizeof(val)) < 0)
+			hal_log_error("eventfd read(): %s(%d)",
+				      strerror(errno), errno);
+	}
+
+	return NULL;
+}
+
+static bool rx_io_read(struct l_io *io, void *user_data)
+{
+	struct radio_frame *frame;
+	struct radio_done *done;
+	uint64_t val;
+
+	if (read(rt->rx_efd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		return true;
+
+	/* Sockets are closed from the main loop: checked against the id */
+	while ((done = ring_peek(rt->done_ring)) != NULL) {
+		if (done->id == sock_id(done->sock))
+			rt->write_func(done->sock, done->ret, rt->user_data);
+		ring_release(rt->done_ring);
+	}
+
+	/* Frames read before the socket got closed and its number reused */
+	while ((frame = ring_peek(rt->rx_ring)) != NULL) {
+		if (frame->id == sock_id(frame->sock))
+			rt->func(frame->sock, frame->buffer, frame->len,
+				 rt->user_data);
+		ring_release(rt->rx_ring);
+	}
+
+	return true;
+}
+
+int radio_thread_start(int mgmtfd, unsigned int batch,
+		       radio_frame_func_t func, radio_write_func_t write_func,
+		       void *user_data)
+{
+	int err;
+
+	if (rt)
+		return -EALREADY;
+
+	rt = l_new(struct radio_thread, 1);
+	rt->mgmtfd = mgmtfd;
+	rt->batch = batch;
+	rt->func = func;
+	rt->write_func = write_func;
+	rt->user_data = user_data;
+	rt->rx_ring = ring_new(RADIO_RING_SLOTS, sizeof(struct radio_frame));
+	rt->tx_ring = ring_new(RADIO_RING_SLOTS, sizeof(struct radio_frame));
+	rt->done_ring = ring_new(RADIO_RING_SLOTS, sizeof(struct radio_done));
+
+	rt->rx_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	rt->tx_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (rt->rx_efd < 0 || rt->tx_efd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	rt->rx_io = l_io_new(rt->rx_efd);
+	l_io_set_read_handler(rt->rx_io, rx_io_read, NULL, NULL);
+
+	rt->running = true;
+	err = -pthread_create(&rt->thread, NULL, thread_run, NULL);
+	if (err < 0) {
+		l_io_destroy(rt->rx_io);
+		goto fail;
+	}
+
+	hal_log_info("Radio thread started");
+
+	return 0;
+
+fail:
+	hal_log_error("Can't start radio thread: %s(%d)", strerror(-err), -err);
+	if (rt->rx_efd >= 0)
+		close(rt->rx_efd);
+	if (rt->tx_efd >= 0)
+		close(rt->tx_efd);
+	ring_free(rt->rx_ring);
+	ring_free(rt->tx_ring);
+	ring_free(rt->done_ring);
+	l_free(rt);
+	rt = NULL;
+
+	return err;
+}
+
+void radio_thread_stop(void)
+{
+	if (!rt)
+		return;
+
+	__atomic_store_n(&rt->running, false, __ATOMIC_RELEASE);
+	efd_signal(rt->tx_efd);
+	pthread_join(rt->thread, NULL);
+
+	/* Frames still queued are dropped */
+	l_io_destroy(rt->rx_io);
+	close(rt->rx_efd);
+	close(rt->tx_efd);
+	ring_free(rt->rx_ring);
+	ring_free(rt->tx_ring);
+	ring_free(rt->done_ring);
+	l_free(rt);
+	rt = NULL;
+
+	hal_log_info("Radio thread stopped");
+}
+
+bool radio_thread_is_running(void)
+{
+	return rt != NULL;
+}
+
+int radio_comm_socket(int protocol)
+{
+	int sock;
+
+	pthread_mutex_lock(&hal_lock);
+
+	sock = hal_comm_socket(HAL_COMM_PF_NRF24, protocol);
+	if (sock >= 0 && rt && protocol == HAL_COMM_PROTO_RAW) {
+		if (rt->nsocks < RADIO_MAX_SOCKS) {
+			if (++rt->next_id == 0)	/* Unknown socket */
+				rt->next_id++;
+
+			rt->socks[rt->nsocks] = sock;
+			rt->ids[rt->nsocks++] = rt->next_id;
+		} else
+			hal_log_error("Radio thread: no room for socket %d",
+				      sock);
+	}
+
+	pthread_mutex_unlock(&hal_lock);
+
+	return sock;
+}
+
+int radio_comm_connect(int sock, uint64_t *addr)
+{
+	int err;
+
+	pthread_mutex_lock(&hal_lock);
+	err = hal_comm_connect(sock, addr);
+	pthread_mutex_unlock(&hal_lock);
+
+	return err;
+}
+
+int radio_comm_close(int sock)
+{
+	int err, i;
+
+	pthread_mutex_lock(&hal_lock);
+
+	for (i = 0; rt && i < rt->nsocks; i++) {
+		if (rt->socks[i] != sock)
+			continue;
+
+		rt->nsocks--;
+		rt->socks[i] = rt->socks[rt->nsocks];
+		rt->ids[i] = rt->ids[rt->nsocks];
+		break;
+	}
+
+	err = hal_comm_close(sock);
+
+	pthread_mutex_unlock(&hal_lock);
+
+	return err;
+}
+
+ssize_t radio_comm_read(int sock, void *buffer, size_t len)
+{
+	ssize_t ret;
+
+	pthread_mutex_lock(&hal_lock);
+	ret = hal_comm_read(sock, buffer, len);
+	pthread_mutex_unlock(&hal_lock);
+
+	return ret;
+}
+
+/*
+ * Radio thread: returns once the frame is queued, the hal_comm_write()
+ * result is reported to write_func later from the main loop.
+ */
+ssize_t radio_comm_write(int sock, const void *buffer, size_t len)
+{
+	struct radio_frame *frame;
+	ssize_t ret;
+
+	if (!rt) {
+		pthread_mutex_lock(&hal_lock);
+		ret = hal_comm_write(sock, buffer, len);
+		pthread_mutex_unlock(&hal_lock);
+
+		return ret;
+	}
+
+	if (len > sizeof(frame->buffer))
+		return -EMSGSIZE;
+
+	frame = ring_reserve(rt->tx_ring);
+	if (!frame)
+		return -ENOBUFS;
+
+	frame->sock = sock;
+	frame->id = sock_id(sock);
+	frame->len = len;
+	memcpy(frame->buffer, buffer, len);
+	ring_commit(rt->tx_ring);
+
+	efd_signal(rt->tx_efd);
+
+	return len;
+}
@@ -0,0 +1,45 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Access to the nRF24 HAL. All socket hal_comm_* calls of the daemon go
+ * through these helpers so that, when the radio thread is enabled, the
+ * thread owns SPI traffic for the mgmt socket and every data socket.
+ */
+
+#define RADIO_BATCH_DEFAULT		8
+#define RADIO_BATCH_MAX			32	/* Frames per socket and pass */
+
+typedef void (*radio_frame_func_t) (int sock, const void *buffer,
+				    size_t len, void *user_data);
+typedef void (*radio_write_func_t) (int sock, ssize_t ret, void *user_data);
+
+int radio_thread_start(int mgmtfd, unsigned int batch,
+		       radio_frame_func_t func, radio_write_func_t write_func,
+		       void *user_data);
+void radio_thread_stop(void);
+bool radio_thread_is_running(void);
+
+int radio_comm_socket(int protocol);
+int radio_comm_connect(int sock, uint64_t *addr);
+int radio_comm_close(int sock);
+ssize_t radio_comm_read(int sock, void *buffer, size_t len);
+ssize_t radio_comm_write(int sock, const void *buffer, size_t len);
@@ -0,0 +1,302 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <ell/ell.h>
+
+#include "hal/linux_log.h"
+
+#include "resolve.h"
+
+#define RESOLVE_MAX_ADDRS		8
+#define RESOLVE_RETRY			5	/* Seconds: lookup failed */
+
+/*
+ * One lookup in flight. getaddrinfo() runs on a detached thread that
+ * signals an eventfd. Shared by the thread and the main loop: the last
+ * one to drop its reference frees it, so resolve_stop() never waits on
+ * a slow DNS server.
+ */
+struct resolve_job {
+	int refs;
+	int efd;
+	struct l_io *io;		/* Main loop only: monitors efd */
+	char *host;
+	char service[8];
+	struct addrinfo *result;
+	int err;
+};
+
+struct resolver {
+	char *host;
+	char service[8];
+	unsigned int ttl;
+	struct sockaddr_storage addrs[RESOLVE_MAX_ADDRS];
+	socklen_t lens[RESOLVE_MAX_ADDRS];
+	int count;
+	int current;			/* Address used by new connects */
+	int failed;			/* Consecutive failed addresses */
+	struct resolve_job *job;
+	struct l_timeout *refresh;	/* TTL expiry or retry */
+};
+
+static struct resolver *resolver;
+
+static void job_unref(struct resolve_job *job)
+{
+	if (__sync_sub_and_fetch(&job->refs, 1))
+		return;
+
+	if (job->result)
+		freeaddrinfo(job->result);
+
+	close(job->efd);
+	l_free(job->host);
+	l_free(job);
+}
+
+static void *resolve_thread(void *user_data)
+{
+	struct resolve_job *job = user_data;
+	struct addrinfo hints;
+	uint64_t value = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_flags = AI_ADDRCONFIG | AI_NUMERICSERV;
+
+	job->err = getaddrinfo(job->host, job->service, &hints, &job->result);
+
+	if (write(job->efd, &value, sizeof(value)) < 0)
+		hal_log_error("resolver: eventfd write failed");
+
+	job_unref(job);
+
+	return NULL;
+}
+
+/* Main loop reference: the l_io goes first, it refers to efd */
+static void job_release(void *user_data)
+{
+	struct resolve_job *job = user_data;
+
+	l_io_destroy(job->io);
+	job->io = NULL;
+	job_unref(job);
+}
+
+static void job_cancel(void)
+{
+	if (!resolver->job)
+		return;
+
+	job_release(resolver->job);
+	resolver->job = NULL;
+}
+
+static void resolve_lookup(void);
+
+static void refresh_cb(struct l_timeout *timeout, void *user_data)
+{
+	resolve_lookup();
+}
+
+static void resolve_schedule(unsigned int seconds)
+{
+	if (resolver->refresh)
+		l_timeout_modify(resolver->refresh, seconds);
+	else
+		resolver->refresh = l_timeout_create(seconds, refresh_cb,
+						     NULL, NULL);
+}
+
+static void job_complete(struct resolve_job *job)
+{
+	struct addrinfo *ai;
+	int count = 0;
+
+	if (job->err) {
+		hal_log_error("resolve %s: %s", job->host,
+			      gai_strerror(job->err));
+		/* Keep cached addresses: better stale than none */
+		resolve_schedule(RESOLVE_RETRY);
+		return;
+	}
+
+	for (ai = job->result; ai && count < RESOLVE_MAX_ADDRS;
+							ai = ai->ai_next) {
+		if (ai->ai_addrlen > sizeof(struct sockaddr_storage))
+			continue;
+
+		memcpy(&resolver->addrs[count], ai->ai_addr, ai->ai_addrlen);
+		resolver->lens[count] = ai->ai_addrlen;
+		count++;
+	}
+
+	resolver->count = count;
+	resolver->current = 0;
+	resolver->failed = 0;
+
+	hal_log_info("resolve %s: %d address(es)", job->host, count);
+
+	resolve_schedule(count ? resolver->ttl : RESOLVE_RETRY);
+}
+
+static bool job_read(struct l_io *io, void *user_data)
+{
+	struct resolve_job *job = resolver->job;
+	uint64_t value;
+
+	if (read(job->efd, &value, sizeof(value)) < 0)
+		return true;
+
+	resolver->job = NULL;
+	job_complete(job);
+
+	/* Never destroy the l_io from its own callback */
+	l_idle_oneshot(job_release, job, NULL);
+
+	return false;
+}
+
+static void resolve_lookup(void)
+{
+	struct resolve_job *job;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int err;
+
+	/* One lookup at a time */
+	if (resolver->job)
+		return;
+
+	job = l_new(struct resolve_job, 1);
+	job->refs = 2;			/* Main loop and thread */
+	job->host = l_strdup(resolver->host);
+	memcpy(job->service, resolver->service, sizeof(job->service));
+	job->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (job->efd < 0) {
+		err = errno;
+		goto fail;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&thread, &attr, resolve_thread, job);
+	pthread_attr_destroy(&attr);
+	if (err)
+		goto fail;
+
+	resolver->job = job;
+	job->io = l_io_new(job->efd);
+	l_io_set_read_handler(job->io, job_read, NULL, NULL);
+
+	return;
+
+fail:
+	hal_log_error("resolver: %s(%d)", strerror(err), err);
+	if (job->efd >= 0)
+		close(job->efd);
+	l_free(job->host);
+	l_free(job);
+
+	resolve_schedule(RESOLVE_RETRY);
+}
+
+int resolve_start(const char *host, unsigned int port, unsigned int ttl)
+{
+	if (resolver)
+		return -EALREADY;
+
+	resolver = l_new(struct resolver, 1);
+	resolver->host = l_strdup(host);
+	snprintf(resolver->service, sizeof(resolver->service), "%u", port);
+	resolver->ttl = ttl ? : RESOLVE_TTL_DEFAULT;
+
+	resolve_lookup();
+
+	return 0;
+}
+
+void resolve_stop(void)
+{
+	if (!resolver)
+		return;
+
+	job_cancel();
+	l_timeout_remove(resolver->refresh);
+	l_free(resolver->host);
+	l_free(resolver);
+	resolver = NULL;
+}
+
+/*
+ * Copies the address new connects should use. Returns its index, to be
+ * given back to resolve_failed(), or -EAGAIN while nothing is resolved.
+ */
+int resolve_get(struct sockaddr_storage *addr, socklen_t *len)
+{
+	if (!resolver || !resolver->count)
+		return -EAGAIN;
+
+	memcpy(addr, &resolver->addrs[resolver->current],
+	       resolver->lens[resolver->current]);
+	*len = resolver->lens[resolver->current];
+
+	return resolver->current;
+}
+
+/*
+ * Connect to the address at index failed: fail over to the next one.
+ * Reports for an address already failed over (connects in flight) are
+ * ignored. Resolves again once every address has failed.
+ */
+void resolve_failed(int index)
+{
+	if (!resolver || index != resolver->current || !resolver->count)
+		return;
+
+	resolver->current = (resolver->current + 1) % resolver->count;
+
+	if (++resolver->failed < resolver->count)
+		return;
+
+	resolver->failed = 0;
+	hal_log_info("resolve %s: every address failed", resolver->host);
+	resolve_lookup();
+}
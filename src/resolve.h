@@ -0,0 +1,36 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * knotd host name resolution off the main loop. Results are cached for
+ * the configured TTL. Connect failures rotate through the resolved
+ * addresses (IPv4 and IPv6) and once every address failed, the name is
+ * resolved again.
+ */
+
+#define RESOLVE_TTL_DEFAULT		300	/* Seconds */
+
+int resolve_start(const char *host, unsigned int port, unsigned int ttl);
+void resolve_stop(void);
+
+int resolve_get(struct sockaddr_storage *addr, socklen_t *len);
+void resolve_failed(int index);
@@ -0,0 +1,97 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+
+#include <ell/ell.h>
+
+#include "ring.h"
+
+struct ring {
+	unsigned int head;	/* Next slot to be written: producer */
+	unsigned int tail;	/* Next slot to be read: consumer */
+	unsigned int mask;
+	size_t slot_size;
+	uint8_t *slots;
+};
+
+struct ring *ring_new(unsigned int slots, size_t slot_size)
+{
+	struct ring *ring;
+
+	/* Index wrapping relies on a power of two number of slots */
+	if (slots == 0 || (slots & (slots - 1)))
+		return NULL;
+
+	ring = l_new(struct ring, 1);
+	ring->mask = slots - 1;
+	ring->slot_size = slot_size;
+	ring->slots = l_malloc(slots * slot_size);
+
+	return ring;
+}
+
+void ring_free(struct ring *ring)
+{
+	if (unlikely(!ring))
+		return;
+
+	l_free(ring->slots);
+	l_free(ring);
+}
+
+void *ring_reserve(struct ring *ring)
+{
+	unsigned int head = ring->head;
+	unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	/* Full? */
+	if (head - tail > ring->mask)
+		return NULL;
+
+	return ring->slots + (head & ring->mask) * ring->slot_size;
+}
+
+void ring_commit(struct ring *ring)
+{
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void *ring_peek(struct ring *ring)
+{
+	unsigned int tail = ring->tail;
+	unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	/* Empty? */
+	if (head == tail)
+		return NULL;
+
+	return ring->slots + (tail & ring->mask) * ring->slot_size;
+}
+
+void ring_release(struct ring *ring)
+{
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
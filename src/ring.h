@@ -0,0 +1,37 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Single producer/single consumer ring of fixed size slots. Producer and
+ * consumer may run on different threads without locking: the producer
+ * fills a slot in place (reserve/commit) and the consumer processes it in
+ * place (peek/release).
+ */
+struct ring;
+
+struct ring *ring_new(unsigned int slots, size_t slot_size);
+void ring_free(struct ring *ring);
+
+void *ring_reserve(struct ring *ring);
+void ring_commit(struct ring *ring);
+
+void *ring_peek(struct ring *ring);
+void ring_release(struct ring *ring);
@@ -36,6 +36,9 @@ static unsigned int port = 8081;
 static const char *spi = "/dev/spidev0.0";
 static int channel = -1;
 static int dbm = -255;
+static bool radio_thread = false;
+static int batch = -1;
+static bool mux = false;
 static bool detach = true;
 static bool help = false;
 
@@ -52,6 +55,9 @@ static void usage(void)
 		"\t-s, --spi          SPI device path\n"
 		"\t-C, --channel      Broadcast channel\n"
 		"\t-t, --tx           TX power: transmition signal strength in dBm\n"
+		"\t-T, --thread       Service the radio from a dedicated thread\n"
+		"\t-b, --batch        Radio frames read per socket and pass\n"
+		"\t-M, --multiplex    Share one knotd connection between devices\n"
 		"\t-n, --nodetach     Logging in foreground\n"
 		"\t-H, --help         Show help options\n");
 }
@@ -64,6 +70,9 @@ static const struct option main_options[] = {
 	{ "spi",		required_argument,	NULL, 's' },
 	{ "channel",		required_argument,	NULL, 'C' },
 	{ "tx",			required_argument,	NULL, 't' },
+	{ "thread",		no_argument,		NULL, 'T' },
+	{ "batch",		required_argument,	NULL, 'b' },
+	{ "multiplex",		no_argument,		NULL, 'M' },
 	{ "nodetach",		no_argument,		NULL, 'n' },
 	{ "help",		no_argument,		NULL, 'H' },
 	{ }
@@ -75,7 +84,7 @@ static int parse_args(int argc, char *argv[], struct settings *settings)
 	int opt;
 
 	for (;;) {
-		opt = getopt_long(argc, argv, "c:f:h:p:s:C:t:nH", main_options, NULL);
+		opt = getopt_long(argc, argv, "c:f:h:p:s:C:t:Tb:MnH", main_options, NULL);
 		if (opt < 0)
 			break;
 
@@ -101,6 +110,15 @@ static int parse_args(int argc, char *argv[], struct settings *settings)
 		case 't':
 			settings->dbm = atoi(optarg);
 			break;
+		case 'T':
+			settings->radio_thread = true;
+			break;
+		case 'b':
+			settings->batch = atoi(optarg);
+			break;
+		case 'M':
+			settings->mux = true;
+			break;
 		case 'n':
 			settings->detach = false;
 			break;
@@ -160,6 +178,9 @@ int settings_parse(int argc, char *argv[], struct settings *settings)
 	settings->spi = spi;
 	settings->channel = channel;
 	settings->dbm = dbm;
+	settings->radio_thread = radio_thread;
+	settings->batch = batch;
+	settings->mux = mux;
 	settings->detach = detach;
 	settings->help = help;
 
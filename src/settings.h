@@ -24,6 +24,7 @@ struct settings {
 	const char *nodes_filename;
 	int config_fd;
 	int nodes_fd;
+	char *nodedb_filename;		/* Binary copy of the nodes file */
 
 	const char *host;
 	unsigned int port;
@@ -31,6 +32,20 @@ struct settings {
 	const char *spi;
 	int channel;
 	int dbm;
+	bool radio_thread;
+	int batch;
+	bool mux;
+	int pool;		/* Pre-connected knotd sockets */
+	unsigned int resolve_ttl;	/* Seconds: knotd host cache */
+	unsigned int retention;	/* Unpaired devices: ms after last seen */
+	bool lazy_devices;	/* Stored devices: D-Bus object on demand */
+	unsigned int device_release;	/* Lazy: ms idle, 0 keeps objects */
+	unsigned int paging_timeout;	/* ms */
+	unsigned int store_frames;	/* knotd outage: 0 disables storing */
+	char *store_dir;		/* Spill overflow: NULL drops it */
+	unsigned int coalesce_window;	/* us: TCP uplink, 0 disables */
+	unsigned int coalesce_bytes;	/* Flush threshold */
+	unsigned int shm_slots;	/* -M over UNIX socket: 0 disables rings */
 
 	bool detach;
 	bool help;
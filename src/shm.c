@@ -0,0 +1,211 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include <ell/ell.h>
+
+#include "hal/linux_log.h"
+
+#include "shm.h"
+
+#define SHM_CACHELINE			64
+
+/*
+ * Shared layout, host byte order. Indices are free running: slot is
+ * index & (slots - 1). Producer and consumer indices live on separate
+ * cache lines.
+ */
+struct shm_ring {
+	uint32_t head;			/* Next slot to be written */
+	uint8_t head_pad[SHM_CACHELINE - sizeof(uint32_t)];
+	uint32_t tail;			/* Next slot to be read */
+	uint8_t tail_pad[SHM_CACHELINE - sizeof(uint32_t)];
+	uint8_t slots[];
+} __attribute__ ((aligned(SHM_CACHELINE)));
+
+struct shm {
+	int memfd;
+	void *map;
+	size_t size;
+	unsigned int mask;
+	struct shm_ring *tx;		/* nrfd -> knotd: first ring */
+	struct shm_ring *rx;		/* knotd -> nrfd: second ring */
+	int tx_efd;			/* Rung by nrfd */
+	int rx_efd;			/* Rung by knotd */
+};
+
+static size_t ring_size(unsigned int slots)
+{
+	return sizeof(struct shm_ring) + (size_t) slots * SHM_SLOT_SIZE;
+}
+
+struct shm *shm_new(unsigned int slots)
+{
+	struct shm *shm;
+	int err;
+
+	/* Index wrapping relies on a power of two number of slots */
+	if (slots < SHM_SLOTS_MIN || slots > SHM_SLOTS_MAX ||
+						(slots & (slots - 1)))
+		return NULL;
+
+	shm = l_new(struct shm, 1);
+	shm->tx_efd = -1;
+	shm->rx_efd = -1;
+	shm->mask = slots - 1;
+	shm->size = 2 * ring_size(slots);
+
+	shm->memfd = memfd_create("nrfd-mux", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (shm->memfd < 0)
+		goto fail;
+
+	if (ftruncate(shm->memfd, shm->size) < 0)
+		goto fail;
+
+	/* knotd maps it as well: the size can't change under it */
+	if (fcntl(shm->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+							F_SEAL_SEAL) < 0)
+		goto fail;
+
+	shm->map = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			shm->memfd, 0);
+	if (shm->map == MAP_FAILED) {
+		shm->map = NULL;
+		goto fail;
+	}
+
+	shm->tx = shm->map;
+	shm->rx = (struct shm_ring *) ((uint8_t *) shm->map +
+				       ring_size(slots));
+
+	shm->tx_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (shm->tx_efd < 0)
+		goto fail;
+
+	shm->rx_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (shm->rx_efd < 0)
+		goto fail;
+
+	return shm;
+
+fail:
+	err = errno;
+	hal_log_error("shm: %s(%d)", strerror(err), err);
+	shm_free(shm);
+
+	return NULL;
+}
+
+void shm_free(struct shm *shm)
+{
+	if (unlikely(!shm))
+		return;
+
+	if (shm->map)
+		munmap(shm->map, shm->size);
+
+	if (shm->memfd >= 0)
+		close(shm->memfd);
+
+	if (shm->tx_efd >= 0)
+		close(shm->tx_efd);
+
+	if (shm->rx_efd >= 0)
+		close(shm->rx_efd);
+
+	l_free(shm);
+}
+
+/* Handed over to knotd: rx_efd also wakes up nrfd */
+void shm_get_fds(const struct shm *shm, int *memfd, int *tx_efd,
+		 int *rx_efd)
+{
+	*memfd = shm->memfd;
+	*tx_efd = shm->tx_efd;
+	*rx_efd = shm->rx_efd;
+}
+
+void *shm_reserve(struct shm *shm)
+{
+	uint32_t head = shm->tx->head;
+	uint32_t tail = __atomic_load_n(&shm->tx->tail, __ATOMIC_ACQUIRE);
+
+	/* Full? */
+	if (head - tail > shm->mask)
+		return NULL;
+
+	return shm->tx->slots + (head & shm->mask) * SHM_SLOT_SIZE;
+}
+
+/*
+ * Publishes the reserved slot. The doorbell is rung only if knotd may
+ * be sleeping: it had consumed every slot before this one.
+ */
+int shm_commit(struct shm *shm)
+{
+	uint32_t head = shm->tx->head;
+	uint64_t value = 1;
+
+	__atomic_store_n(&shm->tx->head, head + 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&shm->tx->tail, __ATOMIC_ACQUIRE) != head)
+		return 0;
+
+	if (write(shm->tx_efd, &value, sizeof(value)) < 0)
+		return -errno;
+
+	return 0;
+}
+
+void *shm_peek(struct shm *shm)
+{
+	uint32_t tail = shm->rx->tail;
+	uint32_t head = __atomic_load_n(&shm->rx->head, __ATOMIC_ACQUIRE);
+
+	/* Empty? */
+	if (head == tail)
+		return NULL;
+
+	return shm->rx->slots + (tail & shm->mask) * SHM_SLOT_SIZE;
+}
+
+/* Pairs with the fence in the producer: no doorbell is missed */
+void shm_release(struct shm *shm)
+{
+	__atomic_store_n(&shm->rx->tail, shm->rx->tail + 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
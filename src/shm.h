@@ -0,0 +1,46 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Shared memory transport for the multiplexed knotd connection: two
+ * single producer/single consumer rings of fixed size slots in a memfd,
+ * one per direction, each with an eventfd doorbell. A slot holds one mux
+ * frame (header and payload). See doc/knotd-mux.txt.
+ */
+
+#define SHM_SLOT_SIZE			528	/* mux frame, 16 aligned */
+#define SHM_SLOTS_MIN			16
+#define SHM_SLOTS_MAX			4096
+
+struct shm;
+
+struct shm *shm_new(unsigned int slots);
+void shm_free(struct shm *shm);
+
+void shm_get_fds(const struct shm *shm, int *memfd, int *tx_efd,
+		 int *rx_efd);
+
+void *shm_reserve(struct shm *shm);
+int shm_commit(struct shm *shm);
+
+void *shm_peek(struct shm *shm);
+void shm_release(struct shm *shm);
@@ -0,0 +1,165 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <ell/ell.h>
+
+#include "hal/linux_log.h"
+
+#include "frame.h"
+#include "spool.h"
+
+#define SPOOL_TEMPLATE			"nrfd-spool-XXXXXX"
+
+/* Records: little endian length followed by the frame data */
+struct spool {
+	int fd;
+	off_t size;			/* Bytes written */
+	unsigned int count;		/* Frames written */
+};
+
+struct spool *spool_new(const char *dir)
+{
+	struct spool *spool;
+	char *path;
+	int fd, err;
+
+	path = l_strdup_printf("%s/%s", dir, SPOOL_TEMPLATE);
+	fd = mkstemp(path);
+	if (fd < 0) {
+		err = errno;
+		hal_log_error("spool %s: %s(%d)", path, strerror(err), err);
+		l_free(path);
+		return NULL;
+	}
+
+	unlink(path);
+	l_free(path);
+
+	spool = l_new(struct spool, 1);
+	spool->fd = fd;
+
+	return spool;
+}
+
+void spool_free(struct spool *spool)
+{
+	if (unlikely(!spool))
+		return;
+
+	close(spool->fd);
+	l_free(spool);
+}
+
+int spool_append(struct spool *spool, const struct frame *frame)
+{
+	uint16_t len = L_CPU_TO_LE16(frame->len);
+	struct iovec iov[2];
+	ssize_t written;
+
+	if (spool->size + sizeof(len) + frame->len > SPOOL_SIZE_MAX)
+		return -ENOSPC;
+
+	iov[0].iov_base = &len;
+	iov[0].iov_len = sizeof(len);
+	iov[1].iov_base = (void *) frame->data;
+	iov[1].iov_len = frame->len;
+
+	written = pwritev(spool->fd, iov, 2, spool->size);
+	if (written < 0)
+		return -errno;
+
+	/* Short write: the record is overwritten by the next one */
+	if ((size_t) written != sizeof(len) + frame->len)
+		return -EIO;
+
+	spool->size += written;
+	spool->count++;
+
+	return 0;
+}
+
+/*
+ * Hands every spooled frame, oldest first, over to func and empties the
+ * spool. Returns the number of frames replayed.
+ */
+int spool_replay(struct spool *spool, spool_frame_func_t func,
+		 void *user_data)
+{
+	struct frame *frame;
+	uint16_t len;
+	off_t offset = 0;
+	int count = 0;
+
+	while (offset < spool->size) {
+		if (pread(spool->fd, &len, sizeof(len), offset) != sizeof(len))
+			break;
+
+		len = L_LE16_TO_CPU(len);
+		if (len > FRAME_SIZE)
+			break;
+
+		offset += sizeof(len);
+
+		frame = frame_new();
+		if (pread(spool->fd, frame->data, len, offset) != len) {
+			frame_unref(frame);
+			break;
+		}
+
+		frame->len = len;
+		offset += len;
+		count++;
+
+		func(frame, user_data);
+	}
+
+	if (offset < spool->size)
+		hal_log_error("spool: %u frame(s) unreadable",
+			      spool->count - count);
+
+	if (ftruncate(spool->fd, 0) < 0)
+		hal_log_error("spool ftruncate(): %s(%d)",
+			      strerror(errno), errno);
+
+	spool->size = 0;
+	spool->count = 0;
+
+	return count;
+}
+
+unsigned int spool_count(const struct spool *spool)
+{
+	return spool ? spool->count : 0;
+}
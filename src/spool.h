@@ -0,0 +1,42 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Uplink frames spilled to disk while knotd is unavailable. The file is
+ * unlinked as soon as it is created: it only lives as long as the spool,
+ * so that a crash never leaves stale frames behind.
+ */
+
+#define SPOOL_SIZE_MAX			(1024 * 1024)	/* Bytes per spool */
+
+struct spool;
+
+/* Takes over the reference of frame */
+typedef void (*spool_frame_func_t) (struct frame *frame, void *user_data);
+
+struct spool *spool_new(const char *dir);
+void spool_free(struct spool *spool);
+
+int spool_append(struct spool *spool, const struct frame *frame);
+int spool_replay(struct spool *spool, spool_frame_func_t func,
+		 void *user_data);
+unsigned int spool_count(const struct spool *spool);
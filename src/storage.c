@@ -28,61 +28,336 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <string.h>
 #include <ell/ell.h>
 
+#include "hal/linux_log.h"
+#include "hal/time.h"
+
+#include "journal.h"
 #include "storage.h"
 #include "settings.h"
 
+#define STORAGE_DEFER_MAX		8	/* Debounce: delays at most */
+
+struct storage {
+	int fd;
+	char *pathname;
+	struct l_settings *settings;
+	bool journaled;			/* Changes appended, not rewritten */
+	struct journal *journal;	/* Opened along with settings */
+	unsigned int delay;		/* Write-behind: ms, 0 writes through */
+	bool dirty;			/* Changes not written yet */
+	uint32_t dirty_since;		/* First change not written */
+	struct l_timeout *flush;
+};
+
 static struct l_hashmap *storage_list = NULL;
 
+static struct storage *storage_lookup(int fd)
+{
+	return l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+}
+
+static struct l_settings *storage_load(struct storage *storage);
+
+static struct l_settings *settings_lookup(int fd)
+{
+	struct storage *storage = storage_lookup(fd);
+
+	return storage ? storage_load(storage) : NULL;
+}
+
+static int save_settings(int fd, struct l_settings *settings)
+{
+	char *res;
+	size_t res_len;
+	int err = 0;
+
+	res = l_settings_to_data(settings, &res_len);
+	if (ftruncate(fd, 0) < 0)
+		err = -errno;
+	else if (pwrite(fd, res, res_len, 0) < 0)
+		err = -errno;
+
+	l_free(res);
+
+	return err;
+}
+
+/*
+ * Journaled stores append the pending changes as one record, and fold
+ * the journal into a new snapshot once it has grown large enough.
+ */
+static int storage_write(struct storage *storage)
+{
+	char *data;
+	size_t len;
+	int err;
+
+	if (!storage->journaled)
+		return save_settings(storage->fd, storage->settings);
+
+	if (!storage->journal)
+		return -EIO;
+
+	err = journal_commit(storage->journal);
+	if (err < 0)
+		return err;
+
+	if (!journal_needs_compaction(storage->journal))
+		return 0;
+
+	data = l_settings_to_data(storage->settings, &len);
+	err = journal_compact(storage->journal, data, len);
+	if (err < 0)
+		hal_log_error("storage compaction: %s(%d)", strerror(-err),
+			      -err);
+
+	return 0;
+}
+
+/* Writes pending changes, if any. Still dirty on failure */
+static int storage_flush(struct storage *storage)
+{
+	int err;
+
+	l_timeout_remove(storage->flush);
+	storage->flush = NULL;
+
+	if (!storage->dirty)
+		return 0;
+
+	err = storage_write(storage);
+	if (err < 0) {
+		hal_log_error("storage flush: %s(%d)", strerror(-err), -err);
+		return err;
+	}
+
+	storage->dirty = false;
+
+	return 0;
+}
+
+static void flush_timeout(struct l_timeout *timeout, void *user_data)
+{
+	storage_flush(user_data);
+}
+
+/* Journaled stores: op goes to the record sealed by storage_changed() */
+static void storage_log(struct storage *storage, enum journal_op op,
+			const char *group, const char *key)
+{
+	if (!storage->journal)
+		return;
+
+	journal_add(storage->journal, op, group, key, key ?
+		    l_settings_get_value(storage->settings, group, key) :
+		    NULL);
+}
+
+/*
+ * Write-behind: a burst of changes is written once, after the store has
+ * been quiet for storage->delay, but no later than STORAGE_DEFER_MAX
+ * delays after the first change.
+ */
+static int storage_changed(struct storage *storage)
+{
+	uint32_t now;
+
+	if (storage->journal)
+		journal_seal(storage->journal);
+
+	now = hal_time_ms();
+	if (!storage->dirty) {
+		storage->dirty = true;
+		storage->dirty_since = now;
+	}
+
+	if (!storage->delay)
+		return storage_flush(storage);
+
+	if (!storage->flush)
+		storage->flush = l_timeout_create_ms(storage->delay,
+						     flush_timeout, storage,
+						     NULL);
+	else if (now - storage->dirty_since <
+					STORAGE_DEFER_MAX * storage->delay)
+		l_timeout_modify_ms(storage->flush, storage->delay);
+
+	return 0;
+}
+
+static void replay_op(enum journal_op op, const char *group,
+		      const char *key, const char *value, void *user_data)
+{
+	struct l_settings *settings = user_data;
+
+	switch (op) {
+	case JOURNAL_SET:
+		l_settings_set_value(settings, group, key, value);
+		break;
+	case JOURNAL_REMOVE:
+		l_settings_remove_group(settings, group);
+		break;
+	}
+}
+
+/*
+ * Parsed on first use: startup can skip it when the known nodes are read
+ * from the binary database. Changes journaled since the last snapshot
+ * are applied on top of it.
+ */
+static struct l_settings *storage_load(struct storage *storage)
+{
+	int err;
+
+	if (storage->settings)
+		return storage->settings;
+
+	storage->settings = l_settings_new();
+	/* Ignore error if file doesn't exists */
+	l_settings_load_from_file(storage->settings, storage->pathname);
+
+	err = journal_replay(storage->pathname, replay_op, storage->settings);
+	if (err < 0)
+		hal_log_error("%s: journal replay: %s(%d)", storage->pathname,
+			      strerror(-err), -err);
+
+	/* Appends follow the replay: it drops torn records */
+	if (storage->journaled)
+		storage->journal = journal_open(storage->pathname);
+
+	return storage->settings;
+}
+
 int storage_open(const char *pathname)
 {
-	struct l_settings *settings;
+	struct storage *storage;
 	int fd;
 
 	fd = open(pathname, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
 	if (fd < 0)
 		return -errno;
 
-	settings = l_settings_new();
-	/* Ignore error if file doesn't exists */
-	l_settings_load_from_file(settings, pathname);
+	storage = l_new(struct storage, 1);
+	storage->fd = fd;
+	storage->pathname = l_strdup(pathname);
 
 	if (!storage_list)
 		storage_list = l_hashmap_new();
 
-	l_hashmap_insert(storage_list, L_INT_TO_PTR(fd), settings);
+	l_hashmap_insert(storage_list, L_INT_TO_PTR(fd), storage);
 
 	return fd;
 }
 
+/* Pending changes are written before closing */
 int storage_close(int fd)
 {
-	struct l_settings *settings;
+	struct storage *storage;
 
-	settings = l_hashmap_remove(storage_list, L_INT_TO_PTR(fd));
-	if(!settings)
+	storage = l_hashmap_remove(storage_list, L_INT_TO_PTR(fd));
+	if(!storage)
 		return -ENOENT;
 
-	l_settings_free(settings);
+	storage_flush(storage);
+	journal_close(storage->journal);
+	l_settings_free(storage->settings);
+	l_free(storage->pathname);
+	l_free(storage);
 
 	return close(fd);
 }
 
-static int save_settings(int fd, struct l_settings *settings)
+/*
+ * Changes are written delay ms after the last one (write-behind) instead
+ * of right away. 0 writes through: every change is written before
+ * returning. See storage_sync() for callers that need durability.
+ */
+int storage_set_write_behind(int fd, unsigned int delay)
 {
-	char *res;
-	size_t res_len;
-	int err = 0;
+	struct storage *storage = storage_lookup(fd);
 
-	res = l_settings_to_data(settings, &res_len);
-	err = ftruncate(fd, 0);
-	if (pwrite(fd, res, res_len, 0) < 0)
-		err = -errno;
+	if (!storage)
+		return -EINVAL;
 
-	l_free(res);
+	storage->delay = delay;
+	if (!delay)
+		return storage_flush(storage);
 
-	return err;
+	return 0;
+}
+
+/* Durability barrier: pending changes are written and on disk */
+int storage_sync(int fd)
+{
+	struct storage *storage = storage_lookup(fd);
+	int err;
+
+	if (!storage)
+		return -EINVAL;
+
+	err = storage_flush(storage);
+	if (err < 0)
+		return err;
+
+	if (storage->journal)
+		return journal_sync(storage->journal);
+
+	if (fdatasync(fd) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Changes are appended to <pathname>.journal instead of rewriting the
+ * whole file, which is only replaced, by rename(), when the journal is
+ * compacted. A power loss then never leaves a truncated store behind.
+ */
+int storage_enable_journal(int fd)
+{
+	struct storage *storage = storage_lookup(fd);
+	int err;
+
+	if (!storage)
+		return -EINVAL;
+
+	if (storage->journaled)
+		return -EALREADY;
+
+	/* Otherwise opened once the store is loaded */
+	if (storage->settings) {
+		/* Changes made so far go to the snapshot */
+		err = storage_flush(storage);
+		if (err < 0)
+			return err;
+
+		storage->journal = journal_open(storage->pathname);
+		if (!storage->journal)
+			return -EIO;
+	}
+
+	storage->journaled = true;
+
+	return 0;
+}
+
+/* Whether the store has been parsed already */
+bool storage_is_loaded(int fd)
+{
+	struct storage *storage = storage_lookup(fd);
+
+	return storage && storage->settings;
+}
+
+/* Changes whenever the store is written to disk */
+uint64_t storage_stamp(int fd)
+{
+	struct storage *storage = storage_lookup(fd);
+
+	return storage ? journal_stamp(storage->pathname) : 0;
 }
 
 void storage_foreach_nrf24_keys(int fd,
@@ -94,7 +369,7 @@ void storage_foreach_nrf24_keys(int fd,
 	char *id;
 	int i;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = settings_lookup(fd);
 	if (!settings)
 		return;
 
@@ -120,23 +395,22 @@ void storage_foreach_nrf24_keys(int fd,
 int storage_write_key_string(int fd, const char *group,
 			     const char *key, const char *value)
 {
-	struct l_settings *settings;
+	struct storage_txn *txn;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
-	if (!settings)
+	txn = storage_begin(fd);
+	if (!txn)
 		return -EIO;
 
-	if (l_settings_set_string(settings, group, key, value) == false)
-		return -EINVAL;
+	storage_txn_set_string(txn, group, key, value);
 
-	return save_settings(fd, settings);
+	return storage_commit(txn);
 }
 
 char *storage_read_key_string(int fd, const char *group, const char *key)
 {
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = settings_lookup(fd);
 	if (!settings)
 		return NULL;
 
@@ -148,23 +422,27 @@ char *storage_read_key_string(int fd, const char *group, const char *key)
 
 int storage_write_key_int(int fd, const char *group, const char *key, int value)
 {
+	struct storage *storage;
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = settings_lookup(fd);
 	if (!settings)
 		return -EINVAL;
 
 	if (l_settings_set_int(settings, group, key, value) == false)
 		return -EINVAL;
 
-	return save_settings(fd, settings);
+	storage = storage_lookup(fd);
+	storage_log(storage, JOURNAL_SET, group, key);
+
+	return storage_changed(storage);
 }
 
 int storage_read_key_int(int fd, const char *group, const char *key, int *value)
 {
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = settings_lookup(fd);
 	if (!settings)
 		return -EINVAL;
 
@@ -180,16 +458,20 @@ int storage_read_key_int(int fd, const char *group, const char *key, int *value)
 int storage_write_key_uint64(int fd, const char *group,
 			     const char *key, uint64_t value)
 {
+	struct storage *storage;
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = settings_lookup(fd);
 	if (!settings)
 		return -EINVAL;
 
 	if (l_settings_set_uint64(settings, group, key, value) == false)
 		return -EINVAL;
 
-	return save_settings(fd, settings);
+	storage = storage_lookup(fd);
+	storage_log(storage, JOURNAL_SET, group, key);
+
+	return storage_changed(storage);
 }
 
 int storage_read_key_uint64(int fd, const char *group,
@@ -197,7 +479,7 @@ int storage_read_key_uint64(int fd, const char *group,
 {
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = settings_lookup(fd);
 	if (!settings)
 		return -EINVAL;
 
@@ -212,14 +494,227 @@ int storage_read_key_uint64(int fd, const char *group,
 
 int storage_remove_group(int fd, const char *group)
 {
+	struct storage *storage;
 	struct l_settings *settings;
 
-	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	settings = settings_lookup(fd);
 	if (!settings)
 		return -EINVAL;
 
 	if (l_settings_remove_group(settings, group) == false)
 		return -EINVAL;
 
-	return save_settings(fd, settings);
+	storage = storage_lookup(fd);
+	storage_log(storage, JOURNAL_REMOVE, group, NULL);
+
+	return storage_changed(storage);
+}
+
+/*
+ * Changes staged by a transaction are applied and written together, as
+ * one journal record or one file rewrite, or not at all. With
+ * write-behind, a commit only stages them: see storage_commit().
+ */
+struct storage_op {
+	char *group;
+	char *key;
+	char *value;
+};
+
+struct storage_txn {
+	int fd;
+	struct l_queue *ops;
+};
+
+static void op_free(void *data)
+{
+	struct storage_op *op = data;
+
+	l_free(op->group);
+	l_free(op->key);
+	l_free(op->value);
+	l_free(op);
+}
+
+static void txn_free(struct storage_txn *txn)
+{
+	l_queue_destroy(txn->ops, op_free);
+	l_free(txn);
+}
+
+struct storage_txn *storage_begin(int fd)
+{
+	struct storage_txn *txn;
+
+	if (!storage_lookup(fd))
+		return NULL;
+
+	txn = l_new(struct storage_txn, 1);
+	txn->fd = fd;
+	txn->ops = l_queue_new();
+
+	return txn;
+}
+
+void storage_txn_set_string(struct storage_txn *txn, const char *group,
+			    const char *key, const char *value)
+{
+	struct storage_op *op;
+
+	op = l_new(struct storage_op, 1);
+	op->group = l_strdup(group);
+	op->key = l_strdup(key);
+	op->value = l_strdup(value);
+
+	l_queue_push_tail(txn->ops, op);
+}
+
+/*
+ * Every change is tried on a scratch copy first, so that applying them
+ * to the store can't fail halfway. Journaled stores also need the whole
+ * transaction to fit in one record.
+ */
+static int txn_check(struct storage_txn *txn, bool journaled)
+{
+	const struct l_queue_entry *entry;
+	struct l_settings *scratch;
+	struct storage_op *op;
+	const char *value;
+	size_t size = 0;
+	int err = 0;
+
+	scratch = l_settings_new();
+
+	for (entry = l_queue_get_entries(txn->ops); entry;
+						entry = entry->next) {
+		op = entry->data;
+
+		if (!l_settings_set_string(scratch, op->group, op->key,
+					   op->value)) {
+			err = -EINVAL;
+			break;
+		}
+
+		value = l_settings_get_value(scratch, op->group, op->key);
+		size += journal_op_size(JOURNAL_SET, op->group, op->key,
+					value);
+	}
+
+	l_settings_free(scratch);
+
+	if (!err && journaled && size > JOURNAL_RECORD_MAX)
+		err = -EMSGSIZE;
+
+	return err;
+}
+
+static void group_copy(struct l_settings *dst, const struct l_settings *src,
+		       const char *group)
+{
+	char **keys;
+	int i;
+
+	keys = l_settings_get_keys(src, group);
+	if (!keys)
+		return;
+
+	for (i = 0; keys[i] != NULL; i++)
+		l_settings_set_value(dst, group, keys[i],
+				     l_settings_get_value(src, group,
+							  keys[i]));
+
+	l_strfreev(keys);
+}
+
+/* Groups changed by txn, as they are before applying it */
+static struct l_settings *txn_backup(struct storage_txn *txn,
+				     const struct l_settings *settings)
+{
+	const struct l_queue_entry *entry;
+	struct l_settings *backup;
+	struct storage_op *op;
+
+	backup = l_settings_new();
+
+	for (entry = l_queue_get_entries(txn->ops); entry;
+						entry = entry->next) {
+		op = entry->data;
+		if (!l_settings_has_group(backup, op->group))
+			group_copy(backup, settings, op->group);
+	}
+
+	return backup;
+}
+
+static void txn_restore(struct storage_txn *txn, struct storage *storage,
+			const struct l_settings *backup)
+{
+	const struct l_queue_entry *entry;
+	struct storage_op *op;
+
+	for (entry = l_queue_get_entries(txn->ops); entry;
+						entry = entry->next) {
+		op = entry->data;
+		l_settings_remove_group(storage->settings, op->group);
+		group_copy(storage->settings, backup, op->group);
+	}
+
+	/* Nothing else pending: flushed before applying txn */
+	if (storage->journal)
+		journal_discard(storage->journal);
+}
+
+/*
+ * Applies and writes the staged changes, all or none: the store is put
+ * back as it was if they can't be written. With write-behind enabled,
+ * success only means the changes are staged: a later write may still
+ * fail, and storage_sync() reports it. Frees txn.
+ */
+int storage_commit(struct storage_txn *txn)
+{
+	const struct l_queue_entry *entry;
+	struct l_settings *backup = NULL;
+	struct storage *storage;
+	struct storage_op *op;
+	int err;
+
+	storage = storage_lookup(txn->fd);
+	if (!storage) {
+		err = -EIO;
+		goto done;
+	}
+
+	storage_load(storage);
+
+	err = txn_check(txn, storage->journaled);
+	if (err < 0 || l_queue_isempty(txn->ops))
+		goto done;
+
+	/* Write-through: txn must be the only change written, or rolled back */
+	if (!storage->delay) {
+		err = storage_flush(storage);
+		if (err < 0)
+			goto done;
+
+		backup = txn_backup(txn, storage->settings);
+	}
+
+	for (entry = l_queue_get_entries(txn->ops); entry;
+						entry = entry->next) {
+		op = entry->data;
+		l_settings_set_string(storage->settings, op->group, op->key,
+				      op->value);
+		storage_log(storage, JOURNAL_SET, op->group, op->key);
+	}
+
+	err = storage_changed(storage);
+	if (err < 0 && backup)
+		txn_restore(txn, storage, backup);
+
+	l_settings_free(backup);
+
+done:
+	txn_free(txn);
+
+	return err;
 }
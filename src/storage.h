@@ -19,6 +19,8 @@
  *
  */
 
+#define STORAGE_WRITE_BEHIND_MAX	60000	/* ms */
+
 typedef void (*storage_foreach_func_t) (const char *mac, const char *id,
 					const char *name, void *user_data);
 
@@ -47,3 +49,17 @@ int storage_remove_group(int fd, const char *group);
 
 int storage_open(const char *pathname);
 int storage_close(int fd);
+
+int storage_set_write_behind(int fd, unsigned int delay);
+int storage_sync(int fd);
+int storage_enable_journal(int fd);
+
+bool storage_is_loaded(int fd);
+uint64_t storage_stamp(int fd);
+
+struct storage_txn;
+
+struct storage_txn *storage_begin(int fd);
+void storage_txn_set_string(struct storage_txn *txn, const char *group,
+			    const char *key, const char *value);
+int storage_commit(struct storage_txn *txn);
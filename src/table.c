@@ -0,0 +1,212 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <ell/ell.h>
+
+#include "table.h"
+
+#define TABLE_INITIAL_SIZE		64	/* Power of two */
+
+enum slot_status {
+	SLOT_EMPTY = 0,
+	SLOT_USED,
+	SLOT_DELETED,		/* Tombstone: keeps probe sequences intact */
+};
+
+struct table_entry {
+	uint64_t key;
+	void *value;
+	int state;
+	enum slot_status status;
+};
+
+struct table {
+	struct table_entry *entries;
+	unsigned int mask;	/* Number of slots - 1 */
+	unsigned int used;
+	unsigned int deleted;
+};
+
+/* MurmurHash3 64-bit finalizer: every key bit affects every hash bit */
+uint32_t table_hash(uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+
+	return key;
+}
+
+static struct table_entry *table_find(struct table *table, uint64_t key)
+{
+	struct table_entry *entry;
+	unsigned int i;
+
+	for (i = table_hash(key) & table->mask; ; i = (i + 1) & table->mask) {
+		entry = &table->entries[i];
+		if (entry->status == SLOT_EMPTY)
+			return NULL;
+
+		if (entry->status == SLOT_USED && entry->key == key)
+			return entry;
+	}
+}
+
+static void table_resize(struct table *table, unsigned int size)
+{
+	struct table_entry *old = table->entries;
+	struct table_entry *entry;
+	unsigned int old_size = table->mask + 1;
+	unsigned int i, j;
+
+	table->entries = l_new(struct table_entry, size);
+	table->mask = size - 1;
+	table->deleted = 0;
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i].status != SLOT_USED)
+			continue;
+
+		for (j = table_hash(old[i].key) & table->mask; ;
+						j = (j + 1) & table->mask) {
+			entry = &table->entries[j];
+			if (entry->status == SLOT_EMPTY)
+				break;
+		}
+
+		*entry = old[i];
+	}
+
+	l_free(old);
+}
+
+struct table *table_new(void)
+{
+	struct table *table;
+
+	table = l_new(struct table, 1);
+	table->entries = l_new(struct table_entry, TABLE_INITIAL_SIZE);
+	table->mask = TABLE_INITIAL_SIZE - 1;
+
+	return table;
+}
+
+void table_free(struct table *table, table_destroy_func_t destroy)
+{
+	unsigned int i;
+
+	if (unlikely(!table))
+		return;
+
+	for (i = 0; destroy && i <= table->mask; i++) {
+		if (table->entries[i].status == SLOT_USED)
+			destroy(table->entries[i].value);
+	}
+
+	l_free(table->entries);
+	l_free(table);
+}
+
+bool table_insert(struct table *table, uint64_t key, void *value, int state)
+{
+	struct table_entry *entry;
+	unsigned int size = table->mask + 1;
+	unsigned int i;
+
+	if (table_find(table, key))
+		return false;
+
+	/* Keep load (tombstones included) under 3/4 */
+	if ((table->used + table->deleted + 1) * 4 > size * 3)
+		table_resize(table, table->used * 2 >= size ? size * 2 : size);
+
+	for (i = table_hash(key) & table->mask; ; i = (i + 1) & table->mask) {
+		entry = &table->entries[i];
+		if (entry->status != SLOT_USED)
+			break;
+	}
+
+	if (entry->status == SLOT_DELETED)
+		table->deleted--;
+
+	entry->key = key;
+	entry->value = value;
+	entry->state = state;
+	entry->status = SLOT_USED;
+	table->used++;
+
+	return true;
+}
+
+void *table_lookup(struct table *table, uint64_t key, int *state)
+{
+	struct table_entry *entry;
+
+	entry = table_find(table, key);
+	if (!entry)
+		return NULL;
+
+	if (state)
+		*state = entry->state;
+
+	return entry->value;
+}
+
+bool table_set_state(struct table *table, uint64_t key, int state)
+{
+	struct table_entry *entry;
+
+	entry = table_find(table, key);
+	if (!entry)
+		return false;
+
+	entry->state = state;
+
+	return true;
+}
+
+void *table_remove(struct table *table, uint64_t key)
+{
+	struct table_entry *entry;
+	void *value;
+
+	entry = table_find(table, key);
+	if (!entry)
+		return NULL;
+
+	value = entry->value;
+	entry->status = SLOT_DELETED;
+	entry->value = NULL;
+	table->used--;
+	table->deleted++;
+
+	return value;
+}
@@ -0,0 +1,40 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Open addressing (linear probing) table keyed by 64-bit nRF24 address.
+ * Each entry carries a small state value that is updated in place, so
+ * state transitions never allocate or move the entry.
+ */
+struct table;
+
+typedef void (*table_destroy_func_t) (void *value);
+
+uint32_t table_hash(uint64_t key);
+
+struct table *table_new(void);
+void table_free(struct table *table, table_destroy_func_t destroy);
+
+bool table_insert(struct table *table, uint64_t key, void *value, int state);
+void *table_lookup(struct table *table, uint64_t key, int *state);
+bool table_set_state(struct table *table, uint64_t key, int state);
+void *table_remove(struct table *table, uint64_t key);
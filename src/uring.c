@@ -0,0 +1,345 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <liburing.h>
+
+#include <ell/ell.h>
+
+#include "hal/linux_log.h"
+
+#include "frame.h"
+#include "uring.h"
+
+#define URING_CQ_ENTRIES		1024	/* Multishot: CQEs per SQE */
+#define URING_BUFFERS			256	/* Power of two */
+#define URING_BUFFER_SIZE		FRAME_SIZE
+#define URING_BGID			0
+
+struct uring_recv {
+	int fd;
+	bool armed;			/* Multishot receive in flight */
+	bool paused;			/* Backpressure: don't re-arm */
+	bool removed;			/* Owner is gone: free once disarmed */
+	uring_recv_func_t recv_func;
+	uring_disconnect_func_t disconnect_func;
+	void *user_data;
+};
+
+struct uring {
+	struct io_uring ring;
+	int efd;			/* Signaled on completions */
+	struct l_io *io;
+	struct io_uring_buf_ring *br;	/* Registered receive buffers */
+	uint8_t *buffers;
+	int mask;
+	struct l_queue *recvs;
+};
+
+static struct uring *uring;
+
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&uring->ring);
+	if (sqe)
+		return sqe;
+
+	/* Submission queue full: flush it and try again */
+	io_uring_submit(&uring->ring);
+
+	return io_uring_get_sqe(&uring->ring);
+}
+
+static bool uring_arm(struct uring_recv *recv)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe();
+	if (!sqe)
+		return false;
+
+	/* Buffer picked by the kernel from the ring: none is pinned idle */
+	io_uring_prep_recv_multishot(sqe, recv->fd, NULL, 0, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	io_uring_sqe_set_data(sqe, recv);
+	recv->armed = true;
+
+	io_uring_submit(&uring->ring);
+
+	return true;
+}
+
+static void uring_cancel(struct uring_recv *recv)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe();
+	if (!sqe)
+		return;
+
+	/* Completion of the cancel request itself is ignored */
+	io_uring_prep_cancel(sqe, recv, 0);
+	io_uring_sqe_set_data(sqe, NULL);
+
+	io_uring_submit(&uring->ring);
+}
+
+static void uring_recycle(unsigned int bid)
+{
+	io_uring_buf_ring_add(uring->br,
+			      uring->buffers + bid * URING_BUFFER_SIZE,
+			      URING_BUFFER_SIZE, bid, uring->mask, 0);
+	io_uring_buf_ring_advance(uring->br, 1);
+}
+
+static void uring_complete(struct io_uring_cqe *cqe)
+{
+	struct uring_recv *recv = io_uring_cqe_get_data(cqe);
+	unsigned int bid;
+	void *buffer;
+
+	if (!recv)
+		return;
+
+	/* Already received: delivered even if paused meanwhile */
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		buffer = uring->buffers + bid * URING_BUFFER_SIZE;
+
+		if (cqe->res > 0 && !recv->removed &&
+		    !recv->recv_func(buffer, cqe->res, recv->user_data) &&
+		    !recv->paused) {
+			recv->paused = true;
+			if (recv->armed)
+				uring_cancel(recv);
+		}
+
+		uring_recycle(bid);
+	}
+
+	/* Cleared last: keeps recv alive if freed from recv_func */
+	if (cqe->flags & IORING_CQE_F_MORE)
+		return;
+
+	recv->armed = false;
+
+	if (recv->removed) {
+		l_queue_remove(uring->recvs, recv);
+		l_free(recv);
+		return;
+	}
+
+	/* Multishot terminated: out of buffers, cancelled or overflow */
+	if (cqe->res > 0 || cqe->res == -ENOBUFS || cqe->res == -ECANCELED) {
+		if (!recv->paused && !uring_arm(recv))
+			recv->disconnect_func(-ENOSPC, recv->user_data);
+		return;
+	}
+
+	/* 0: orderly shutdown */
+	recv->disconnect_func(cqe->res, recv->user_data);
+}
+
+static bool uring_read(struct l_io *io, void *user_data)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head, count = 0;
+	uint64_t value;
+
+	if (read(uring->efd, &value, sizeof(value)) < 0)
+		return true;
+
+	/* Every socket with data: one wakeup */
+	io_uring_for_each_cqe(&uring->ring, head, cqe) {
+		uring_complete(cqe);
+		count++;
+	}
+
+	io_uring_cq_advance(&uring->ring, count);
+
+	return true;
+}
+
+int uring_start(unsigned int entries)
+{
+	struct io_uring_params params;
+	unsigned int i;
+	int err;
+
+	if (uring)
+		return -EALREADY;
+
+	uring = l_new(struct uring, 1);
+	uring->efd = -1;
+
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = URING_CQ_ENTRIES;
+
+	err = io_uring_queue_init_params(entries, &uring->ring, &params);
+	if (err < 0) {
+		l_free(uring);
+		uring = NULL;
+		return err;
+	}
+
+	/* Requires Linux 5.19: older kernels use the l_io path */
+	uring->br = io_uring_setup_buf_ring(&uring->ring, URING_BUFFERS,
+					    URING_BGID, 0, &err);
+	if (!uring->br)
+		goto fail;
+
+	uring->mask = io_uring_buf_ring_mask(URING_BUFFERS);
+	uring->buffers = l_malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+	for (i = 0; i < URING_BUFFERS; i++)
+		io_uring_buf_ring_add(uring->br,
+				      uring->buffers + i * URING_BUFFER_SIZE,
+				      URING_BUFFER_SIZE, i, uring->mask, i);
+	io_uring_buf_ring_advance(uring->br, URING_BUFFERS);
+
+	uring->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (uring->efd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = io_uring_register_eventfd(&uring->ring, uring->efd);
+	if (err < 0)
+		goto fail;
+
+	/* Optional: skips the fd lookup on every io_uring_enter() */
+	io_uring_register_ring_fd(&uring->ring);
+
+	uring->recvs = l_queue_new();
+	uring->io = l_io_new(uring->efd);
+	l_io_set_close_on_destroy(uring->io, true);
+	l_io_set_read_handler(uring->io, uring_read, NULL, NULL);
+
+	return 0;
+
+fail:
+	if (uring->efd >= 0)
+		close(uring->efd);
+
+	if (uring->br)
+		io_uring_free_buf_ring(&uring->ring, uring->br, URING_BUFFERS,
+				       URING_BGID);
+
+	io_uring_queue_exit(&uring->ring);
+	l_free(uring->buffers);
+	l_free(uring);
+	uring = NULL;
+
+	return err;
+}
+
+void uring_stop(void)
+{
+	if (!uring)
+		return;
+
+	/* Closes efd */
+	l_io_destroy(uring->io);
+
+	/* Outstanding receives are cancelled by the kernel */
+	io_uring_free_buf_ring(&uring->ring, uring->br, URING_BUFFERS,
+			       URING_BGID);
+	io_uring_queue_exit(&uring->ring);
+
+	l_queue_destroy(uring->recvs, l_free);
+	l_free(uring->buffers);
+	l_free(uring);
+	uring = NULL;
+}
+
+bool uring_is_running(void)
+{
+	return uring != NULL;
+}
+
+/* fd stays owned by the caller: call uring_recv_free() before close() */
+struct uring_recv *uring_recv_new(int fd, uring_recv_func_t recv_func,
+				  uring_disconnect_func_t disconnect_func,
+				  void *user_data)
+{
+	struct uring_recv *recv;
+
+	if (!uring)
+		return NULL;
+
+	recv = l_new(struct uring_recv, 1);
+	recv->fd = fd;
+	recv->recv_func = recv_func;
+	recv->disconnect_func = disconnect_func;
+	recv->user_data = user_data;
+
+	if (!uring_arm(recv)) {
+		l_free(recv);
+		return NULL;
+	}
+
+	l_queue_push_tail(uring->recvs, recv);
+
+	return recv;
+}
+
+/* Completions may still be in flight: released once disarmed */
+void uring_recv_free(struct uring_recv *recv)
+{
+	/* uring_stop() has released it already */
+	if (!recv || !uring)
+		return;
+
+	recv->removed = true;
+
+	if (recv->armed) {
+		uring_cancel(recv);
+		return;
+	}
+
+	l_queue_remove(uring->recvs, recv);
+	l_free(recv);
+}
+
+void uring_recv_resume(struct uring_recv *recv)
+{
+	if (!recv || !recv->paused)
+		return;
+
+	recv->paused = false;
+
+	/* Still armed if the cancel has not completed yet */
+	if (!recv->armed && !uring_arm(recv))
+		recv->disconnect_func(-ENOSPC, recv->user_data);
+}
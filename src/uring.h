@@ -0,0 +1,84 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Optional io_uring engine for knotd sockets (--enable-io-uring). A
+ * multishot receive per socket fills buffers of a ring registered with
+ * the kernel, and completions for every socket are reaped on a single
+ * eventfd wakeup: no epoll round trip and read() per frame. Without it,
+ * uring_start() fails and callers keep reading from l_io handlers.
+ */
+
+#define URING_ENTRIES			64	/* Submission queue */
+
+struct uring_recv;
+
+/* Returning false pauses the receive until uring_recv_resume() */
+typedef bool (*uring_recv_func_t) (const void *buffer, size_t len,
+				   void *user_data);
+typedef void (*uring_disconnect_func_t) (int err, void *user_data);
+
+#ifdef HAVE_IO_URING
+
+int uring_start(unsigned int entries);
+void uring_stop(void);
+bool uring_is_running(void);
+
+struct uring_recv *uring_recv_new(int fd, uring_recv_func_t recv_func,
+				  uring_disconnect_func_t disconnect_func,
+				  void *user_data);
+void uring_recv_free(struct uring_recv *recv);
+void uring_recv_resume(struct uring_recv *recv);
+
+#else
+
+static inline int uring_start(unsigned int entries)
+{
+	return -ENOTSUP;
+}
+
+static inline void uring_stop(void)
+{
+}
+
+static inline bool uring_is_running(void)
+{
+	return false;
+}
+
+static inline struct uring_recv *uring_recv_new(int fd,
+				uring_recv_func_t recv_func,
+				uring_disconnect_func_t disconnect_func,
+				void *user_data)
+{
+	return NULL;
+}
+
+static inline void uring_recv_free(struct uring_recv *recv)
+{
+}
+
+static inline void uring_recv_resume(struct uring_recv *recv)
+{
+}
+
+#endif
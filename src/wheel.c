@@ -0,0 +1,202 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <ell/ell.h>
+
+#include "wheel.h"
+
+#define WHEEL_BITS		6
+#define WHEEL_SLOTS		(1 << WHEEL_BITS)
+#define WHEEL_MASK		(WHEEL_SLOTS - 1)
+#define WHEEL_SPAN		(1 << (2 * WHEEL_BITS))	/* In ticks */
+
+struct wheel_node {
+	uint64_t key;
+	void *data;
+	uint32_t expire;		/* In ticks */
+	struct wheel_node *next;
+};
+
+struct wheel {
+	struct wheel_node *level0[WHEEL_SLOTS];	/* One tick per slot */
+	struct wheel_node *level1[WHEEL_SLOTS];	/* WHEEL_SLOTS ticks */
+	uint32_t tick;			/* Next tick to run */
+	uint32_t base;			/* Timestamp (ms) of tick */
+	unsigned int tick_ms;
+	unsigned int count;
+};
+
+static void node_link(struct wheel_node **slot, struct wheel_node *node)
+{
+	node->next = *slot;
+	*slot = node;
+}
+
+static void wheel_place(struct wheel *wheel, struct wheel_node *node)
+{
+	uint32_t delta = node->expire - wheel->tick;
+	uint32_t expire = node->expire;
+
+	if ((int32_t) delta < 0)
+		expire = wheel->tick;
+	else if (delta >= WHEEL_SPAN)
+		/* Too far: parked in the last slot, placed again on cascade */
+		expire = wheel->tick + WHEEL_SPAN - 1;
+
+	if ((int32_t) delta < WHEEL_SLOTS)
+		node_link(&wheel->level0[expire & WHEEL_MASK], node);
+	else
+		node_link(&wheel->level1[(expire >> WHEEL_BITS) & WHEEL_MASK],
+			  node);
+}
+
+static void wheel_cascade(struct wheel *wheel)
+{
+	struct wheel_node **slot;
+	struct wheel_node *node;
+
+	slot = &wheel->level1[(wheel->tick >> WHEEL_BITS) & WHEEL_MASK];
+	node = *slot;
+	*slot = NULL;
+
+	while (node) {
+		struct wheel_node *next = node->next;
+
+		wheel_place(wheel, node);
+		node = next;
+	}
+}
+
+struct wheel *wheel_new(uint32_t now, unsigned int tick_ms)
+{
+	struct wheel *wheel;
+
+	wheel = l_new(struct wheel, 1);
+	wheel->base = now;
+	wheel->tick_ms = tick_ms ? : 1;
+
+	return wheel;
+}
+
+static void node_list_free(struct wheel_node *node)
+{
+	struct wheel_node *next;
+
+	for (; node; node = next) {
+		next = node->next;
+		l_free(node);
+	}
+}
+
+void wheel_free(struct wheel *wheel)
+{
+	int i;
+
+	if (unlikely(!wheel))
+		return;
+
+	for (i = 0; i < WHEEL_SLOTS; i++) {
+		node_list_free(wheel->level0[i]);
+		node_list_free(wheel->level1[i]);
+	}
+
+	l_free(wheel);
+}
+
+void wheel_add(struct wheel *wheel, uint32_t expire, uint64_t key,
+	       void *data)
+{
+	struct wheel_node *node;
+	int32_t delta = expire - wheel->base;
+
+	node = l_new(struct wheel_node, 1);
+	node->key = key;
+	node->data = data;
+
+	/* Round up: never expire before the requested time */
+	if (delta <= 0)
+		node->expire = wheel->tick;
+	else
+		node->expire = wheel->tick +
+			(delta + wheel->tick_ms - 1) / wheel->tick_ms;
+
+	wheel_place(wheel, node);
+	wheel->count++;
+}
+
+/*
+ * Runs every tick up to now. func may add entries again: they always
+ * land on a later tick.
+ */
+unsigned int wheel_advance(struct wheel *wheel, uint32_t now,
+			   wheel_expire_func_t func, void *user_data)
+{
+	struct wheel_node **slot;
+	struct wheel_node *node;
+	unsigned int expired = 0;
+	uint32_t ticks;
+
+	if ((int32_t) (now - wheel->base) < 0)
+		return 0;
+
+	/* Nothing pending: skip the empty ticks at once */
+	if (!wheel->count) {
+		ticks = (now - wheel->base) / wheel->tick_ms + 1;
+		wheel->tick += ticks;
+		wheel->base += ticks * wheel->tick_ms;
+		return 0;
+	}
+
+	while ((int32_t) (now - wheel->base) >= 0) {
+		if ((wheel->tick & WHEEL_MASK) == 0)
+			wheel_cascade(wheel);
+
+		slot = &wheel->level0[wheel->tick & WHEEL_MASK];
+		while ((node = *slot)) {
+			*slot = node->next;
+			wheel->count--;
+			expired++;
+
+			if (func)
+				func(node->key, node->data, user_data);
+
+			l_free(node);
+		}
+
+		wheel->tick++;
+		wheel->base += wheel->tick_ms;
+	}
+
+	return expired;
+}
+
+unsigned int wheel_count(struct wheel *wheel)
+{
+	return wheel->count;
+}
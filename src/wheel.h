@@ -0,0 +1,40 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Two-level hierarchical timer wheel. Timestamps are hal_time_ms()
+ * values: wrap-around safe. Expiry costs O(expired): entries only move
+ * when their level 1 slot cascades into level 0.
+ */
+struct wheel;
+
+typedef void (*wheel_expire_func_t) (uint64_t key, void *data,
+				     void *user_data);
+
+struct wheel *wheel_new(uint32_t now, unsigned int tick_ms);
+void wheel_free(struct wheel *wheel);
+
+void wheel_add(struct wheel *wheel, uint32_t expire, uint64_t key,
+	       void *data);
+unsigned int wheel_advance(struct wheel *wheel, uint32_t now,
+			   wheel_expire_func_t func, void *user_data);
+unsigned int wheel_count(struct wheel *wheel);